@@ -0,0 +1,172 @@
+#!/bin/sh
+#
+# Benchmark suite: runs a fixed set of headless battles, prints one JSON
+# object per scenario and compares them against bench-baseline.json.
+#
+# usage: bench.sh [--update]
+#
+# --update rewrites the baseline with this run instead of comparing.
+# BENCH_TOLERANCE is the percentage a result may be worse than the baseline
+# before it counts as a regression (default: 30). BENCH_RUNS is the number
+# of runs per scenario, of which the best is kept (default: 3).
+#
+# The replay scenario replays one log on both THREADS and THREADS_FIXED,
+# the fixed size build, whose board BOARD_WIDTH, BOARD_HEIGHT and
+# BOARD_WORLD must give (make bench passes the Makefile's).
+#
+
+THREADS=${THREADS:-./threads}
+THREADS_FIXED=${THREADS_FIXED:-./threads-fixed}
+BOARD_WIDTH=${BOARD_WIDTH:-80}
+BOARD_HEIGHT=${BOARD_HEIGHT:-24}
+BOARD_WORLD=${BOARD_WORLD:-$BOARD_WIDTH}
+BASELINE=${BASELINE:-bench-baseline.json}
+TOLERANCE=${BENCH_TOLERANCE:-30}
+RUNS=${BENCH_RUNS:-3}
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+# city of cols columns of height h, after the given header lines
+city() {
+    cols=$1 h=$2
+    shift 2
+    printf 'Defender\nAttacker\n0\n'
+    printf '%s\n' "$@"
+    awk -v n="$cols" -v h="$h" 'BEGIN {
+	for (i = 1; i <= n; i++) printf "%d%s", h, (i < n) ? " ": "\n"
+    }'
+}
+
+city 100000 3 engine=tick inflight=4000 rate=20000 > "$dir/skyline.txt"
+city 2000 3 engine=tick inflight=100000 rate=30000 > "$dir/infinite.txt"
+city 20 15 engine=tick shields=4 inflight=64 rate=20000 > "$dir/saturated.txt"
+city "$BOARD_WORLD" $((BOARD_HEIGHT * 2 / 3)) engine=tick inflight=64 \
+	rate=400 > "$dir/replay.txt"
+
+# the replayed log, recorded at the fixed build's board size until the
+# city is razed
+if ! out=$("$THREADS" --headless --seed 1 --width "$BOARD_WIDTH" \
+	--height "$BOARD_HEIGHT" --speedup 10000 --duration 3000 \
+	--record "$dir/replay.log" "$dir/replay.txt" 2>&1); then
+    printf '%s\n' "$out" >&2
+    echo "bench: recording the replay log failed" >&2
+    exit 1
+fi
+
+# name and binary, then the arguments of one run. A replay is over too
+# soon to time, so its rates are per second of tick engine time.
+scenario() {
+    name=$1 bin=$2
+    shift 2
+    best=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+	if ! out=$("$bin" "$@" 2>&1); then
+	    printf '%s\n' "$out" >&2
+	    echo "bench: $name failed" >&2
+	    exit 1
+	fi
+	line=$(printf '%s\n' "$out" | awk -v name="$name" '
+	    /^matches:/ { tps = $(NF) ; gsub(/[(\/s)]/, "", tps) }
+	    /^memory:/ || /^peak rss:/ { rss = $(NF - 1) }
+	    /^load time:/ { load = $3 }
+	    /^missiles:/ { mps = $(NF) ; gsub(/[(\/s)]/, "", mps) }
+	    /^missiles:.* in / { landed = $4 }
+	    /^tick time:/ {
+		mean = $4
+		ticks = $(NF - 1)
+		gsub(/\(/, "", ticks)
+	    }
+	    END {
+		if (tps == "") {
+		    tps = sprintf("%.0f", 1e6 / mean)
+		    mps = sprintf("%.1f", landed * 1e6 / mean / ticks)
+		}
+		printf "{\"scenario\": \"%s\", \"load_ms\": %s, " \
+			"\"ticks_per_s\": %s, \"missiles_per_s\": %s, " \
+			"\"peak_rss_kb\": %s}\n", name, load, tps, mps, rss
+	    }')
+	# keep the run with the most ticks per second
+	if [ -z "$best" ] || [ "$(printf '%s\n%s\n' "$best" "$line" |
+		awk -F'"ticks_per_s": ' '{ split($2, v, ","); t[NR] = v[1] }
+		END { print (t[2] > t[1]) }')" = 1 ]; then
+	    best=$line
+	fi
+	hits=$(printf '%s\n' "$out" | grep '^hits:')
+	i=$((i + 1))
+    done
+    printf '%s\n' "$best"
+}
+
+{
+    scenario example "$THREADS" --seed 1 --matches 200 --duration 60 \
+	    config-example.txt
+    scenario skyline "$THREADS" --seed 1 --matches 1 --duration 10 \
+	    "$dir/skyline.txt"
+    scenario infinite "$THREADS" --seed 1 --matches 1 --duration 10 \
+	    "$dir/infinite.txt"
+    scenario saturated "$THREADS" --seed 1 --matches 100 --width 20 \
+	    --duration 30 "$dir/saturated.txt"
+    scenario replay "$THREADS" --replay "$dir/replay.log" \
+	    "$dir/replay.txt"
+    dynamic=$hits
+    scenario replay-fixed "$THREADS_FIXED" --replay "$dir/replay.log" \
+	    "$dir/replay.txt"
+    # both builds must fight the same battle
+    if [ "$hits" != "$dynamic" ]; then
+	echo "bench: replay-fixed $hits, replay $dynamic" >&2
+	exit 1
+    fi
+} > "$dir/results.json" || exit 1
+cat "$dir/results.json"
+
+if [ "$1" = --update ]; then
+    cp "$dir/results.json" "$BASELINE"
+    echo "bench: baseline written to $BASELINE"
+    exit 0
+fi
+if [ ! -f "$BASELINE" ]; then
+    echo "bench: no baseline, run make bench-baseline first" >&2
+    exit 1
+fi
+
+# rates must not fall below, and load time and memory not rise above, the
+# baseline by more than the tolerance; load time and memory get a little
+# slack so tiny values do not trip on noise
+awk -v tol="$TOLERANCE" '
+    function field(s, key,    v) {
+	v = s
+	sub(".*\"" key "\": ", "", v)
+	sub(/[,}].*/, "", v)
+	return v + 0
+    }
+    # up is 1 when a higher value is worse
+    function check(key, up, slack,    b, v, worse) {
+	b = field(base[name], key)
+	v = field($0, key)
+	if (up) worse = v > b * (1 + tol / 100) + slack
+	else worse = v < b * (1 - tol / 100)
+	if (worse) {
+	    printf "bench: %s %s regressed: %g, baseline %g\n", name, key,
+		    v, b
+	    failed = 1
+	}
+    }
+    {
+	name = $0
+	sub(/.*"scenario": "/, "", name)
+	sub(/".*/, "", name)
+    }
+    FNR == NR { base[name] = $0; next }
+    !(name in base) { printf "bench: %s not in baseline\n", name; next }
+    {
+	check("load_ms", 1, 0.5)
+	check("ticks_per_s", 0, 0)
+	check("missiles_per_s", 0, 0)
+	check("peak_rss_kb", 1, 1024)
+    }
+    END {
+	if (!failed) printf "bench: no regressions (tolerance %d%%)\n", tol
+	exit failed
+    }' "$BASELINE" "$dir/results.json"
@@ -9,6 +9,81 @@
 
 #define _DEFAULT_SOURCE
 #define MAX_DELAY_MS 300
+#define STRIPE_COLS 8 // columns per lock stripe
+#define NSTRIPES 64
+#define MAX_BACKOFF 64 // most pauses between steal rounds, then yields
+#define NAME_MAX_LEN 80
+#define LEVEL_MAGIC "CDL1"
+#define KEY_QUEUE_LEN 64 // power of two
+#define MAX_SHIELDS 4
+#define MAX_THREADS 256
+#define REPLAY_MAGIC "CDR2" // CDR1 logs predate the roof and do not replay
+#define EVENT_LEFT 0 // replay log events
+#define EVENT_RIGHT 1
+#define EVENT_END 2
+#define EVENT_SHIELD 3 // later moves are by the shield in the other bits
+#define PROFILE_STEADY 0 // attacker launch profiles
+#define PROFILE_RAMP 1
+#define PROFILE_SPIKE 2
+#define SPIKE_FACTOR 10 // spike profile rate multiplier
+#define HANDLE_INDEX_BITS 20 // low bits of a missile handle are its slot
+#define HANDLE_INDEX_MASK ((1u << HANDLE_INDEX_BITS) - 1)
+#define NO_MISSILE 0 // handle that never names a missile
+#define STEP_WAIT 0 // missile does not move this tick
+#define STEP_CLEAR 1 // missile moves and cannot hit the city
+#define STEP_CHECK 2 // missile moves and may hit the city or shield
+#define STEP_LANDED 3 // missile exploded or left the screen this tick
+#define NO_TASK -1 // deque was empty
+#define LOST_TASK -2 // another worker took the task first
+#define MIN_PARALLEL_MOVES 256 // fewer moves in a tick stay on one thread
+#define FRAME_FRESH 4 // set in frames.middle until the frame is shown
+#define MIN_FPS 4 // frame rate a slow terminal is paced down to at most
+#define PACE_HEADROOM_NUM 5 // frame interval over the mean flush time,
+#define PACE_HEADROOM_DEN 4 // as a fraction
+#define NET_MAGIC "CDN1"
+#define MSG_LEN 128 // longest message posted, with its terminator
+#define MSG_SLOTS 64 // messages posted and not yet laid out
+#define MSG_LOG -1 // message goes to the log rather than a status row
+#define ERROR_ROW 2 // status row of postError, below the stats overlay
+#define LOG_TOP 3 // first row of the message log, below the status rows
+#define MSG_HELLO 0 // network messages from server
+#define MSG_FRAME 1
+#define MAX_CLIENTS 16
+#define CLIENT_BACKLOG 65536 // unsent bytes before a client is resynced
+#define CHUNK_COLS 64 // columns per chunk of an endless city
+#define CHUNK_SPARE 6 // chunks in the ring beyond those the view spans
+#define CHUNK_LEAD 25 // ticks from asking for a chunk to showing it, lockstep
+#define CHUNK_STREAM ((uint64_t) 1 << 32) // random stream of chunk 0
+#ifndef SHIELD_WIDTH
+#define SHIELD_WIDTH 5
+#endif
+
+// a fixed build (make fixed) bakes the board size in as constants
+#ifdef BOARD_WIDTH
+#ifndef BOARD_HEIGHT
+#error "BOARD_WIDTH requires BOARD_HEIGHT"
+#endif
+#ifndef BOARD_WORLD
+#define BOARD_WORLD BOARD_WIDTH // columns simulated, at least BOARD_WIDTH
+#endif
+#if BOARD_WIDTH < SHIELD_WIDTH || BOARD_HEIGHT < 1 || BOARD_WORLD < BOARD_WIDTH
+#error "board too small"
+#endif
+#define WORLD_WIDTH BOARD_WORLD
+#define HEIGHT BOARD_HEIGHT
+#define WIDTH BOARD_WIDTH
+#define DEFAULT_HEIGHT BOARD_HEIGHT // board size before one is set
+#define DEFAULT_WIDTH BOARD_WIDTH
+#else
+#define WORLD_WIDTH (game->worldWidth)
+#define HEIGHT (game->height)
+#define WIDTH (game->width)
+#define DEFAULT_HEIGHT 24
+#define DEFAULT_WIDTH 80
+#endif
+#define ROW_WORDS ((WORLD_WIDTH + 63) / 64) // 64-bit words of a row bitset
+#define MAX_TALL 255 // tallest building a layout byte holds
+#define LAYOUT_PAD 3 // bytes past the layout a gather of 4 bytes may read
 
 #include <stdio.h>
 #include <string.h>
@@ -19,54 +94,726 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/**
+ * Mutex that times how long it is held
+ */
+struct Lock {
+    pthread_mutex_t mutex;
+    struct timespec locked; // when mutex was last acquired
+};
+
+_Thread_local struct Game *game; // match this thread works on
+_Bool headless; // no terminal, nothing is drawn
+int speedup = 1; // divides every simulation delay
+_Bool serving; // frames are streamed to network clients, see --serve
+int signals = -1; // signalfd of the signals that stop a game, see watchSignals
+int signalWake[2] = { -1, -1 }; // written once to end the signal thread
+atomic_int caught; // last signal read from signals, 0 if none
+
+/**
+ * Replay log being played back, see --replay
+ */
+struct Replay {
+    unsigned char *data;
+    size_t len;
+    size_t pos; // next event
+    unsigned tick; // tick of last event read
+    int shield; // shield moved by the events that follow
+};
+
+/**
+ * Header of a replay log. It is followed by one event per shield move
+ * and one at the end of the game, each a LEB128 varint of the ticks since
+ * the previous event shifted left by two, ORed with the EVENT_* code. An
+ * EVENT_SHIELD event holds a shield index in place of the ticks, and
+ * selects the shield the moves after it apply to; moves with none before
+ * them are by shield 0. Integers are in host order.
+ */
+struct ReplayHeader {
+    char magic[4];
+    uint32_t configHash; // of the config the log was recorded with
+    uint64_t seed;
+    int32_t width;
+    int32_t height;
+};
+
+/**
+ * Triple buffer of frames, each a copy of the view as height rows of
+ * width glyphs. The render thread composes the view into its image,
+ * copies it to the back frame and swaps that with the middle frame. The
+ * output thread swaps the middle frame for its front frame when a fresh
+ * one is there and writes it to the terminal. Neither thread ever waits
+ * for the other, and a frame never changes once it is published.
+ */
+struct Frames {
+    char *cells[3];
+    atomic_int middle; // index of middle frame, | FRAME_FRESH if unshown
+    int back; // owned by render thread
+    int front; // owned by output thread
+    char *image; // view as composed so far, owned by render thread
+    char *shown; // what the curses window holds, owned by output thread
+    pthread_mutex_t lock; // only for waiting on ready
+    pthread_cond_t ready; // a fresh frame was published, or stop was set
+    _Bool stop;
+    int notify[2]; // pipe written like ready when serving, else -1
+    atomic_long flushNs; // moving average of terminal flush time
+} frames = { .notify = { -1, -1 } };
+
+/**
+ * State of a PCG32 random number generator
+ */
+struct Rng {
+    uint64_t state;
+    uint64_t inc;
+};
+
+_Thread_local struct Rng rng; // this thread's generator, see seedThread
+
+#define HIST_SUB 16
+
+/**
+ * Log-linear histogram of durations in nanoseconds, buckets are within
+ * 1/HIST_SUB of their value. Safe to add to from any thread.
+ */
+struct Histogram {
+    atomic_ullong count[64 * HIST_SUB];
+    atomic_ullong n;
+    atomic_ullong total;
+};
+
+/**
+ * Event counters of one thread. Only the owning thread adds to them, so
+ * adding never contends; readers sum every thread's counters without
+ * locking. Threads past MAX_THREADS share the last slot.
+ */
+struct Counters {
+    _Alignas(64) const char *role;
+    atomic_ullong launched;
+    atomic_ullong blocked; // missiles stopped by the shield
+    atomic_ullong cityHits;
+    atomic_ullong lockWaits; // lock() calls that found the lock taken
+    atomic_ullong lockWaitNs;
+    atomic_ullong refreshes;
+    atomic_ullong refreshNs;
+    atomic_ullong netBytes; // sent to network clients
+};
+
+struct Counters counters[MAX_THREADS];
+atomic_int nthreads; // counters handed out
+_Thread_local struct Counters *mine; // this thread's counters
 
-struct Game *game;
-int height, width;
-int row = 2, col;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * Measurements reported by a headless run
+ */
+struct Bench {
+    atomic_ullong landed;
+    struct Histogram lockHold;
+    struct Histogram shield;
+    struct Histogram frame;
+    struct Histogram tick;
+    const char *kernel; // step kernel used by the tick engine
+} bench;
+
+/**
+ * Slot of the message ring. seq is the ring position the slot can be
+ * claimed at, or that position + 1 once its message is ready.
+ */
+struct Message {
+    atomic_uint seq;
+    int row; // status row, or MSG_LOG
+    char text[MSG_LEN];
+};
+
+/**
+ * Slot of the ring of chunks of an endless city. Fields are guarded by
+ * the stream lock.
+ */
+struct Chunk {
+    long seq; // chunk of the city wanted in this slot
+    long shown; // chunk whose heights are in the layout
+    long staged; // chunk whose heights are in heights, or -1
+    uint8_t *heights; // CHUNK_COLS heights, filled by the loader
+    unsigned deadline; // tick the engine shows the chunk on, in lockstep
+};
+
+/**
+ * City that goes on past its last column. The world is a ring of nslots
+ * chunks of CHUNK_COLS columns, chunk n of the city in slot n % nslots,
+ * so world col x shows the city col congruent to x in the chunks loaded.
+ * As the view moves on, the chunk furthest behind it is handed to the
+ * loader thread to be refilled with the next one ahead.
+ */
+struct Stream {
+    struct Chunk *slots;
+    int nslots;
+    long first; // first chunk in the ring; shieldLock and lock
+    atomic_int pending; // slots whose chunk is not shown yet
+    uint8_t *city; // heights of the config's city, the start of the stream
+    int citySize;
+    int fd; // level file continuing the city, or -1 to generate it
+    size_t heightsAt; // offset of its packed heights
+    int heightBytes;
+    uint32_t columns;
+    int tallest; // tallest building its header claims
+    uint32_t identity; // hash of its size, header and first chunk of heights
+    pthread_t loader;
+    _Bool started; // loader is running
+    _Bool stop; // loader should exit
+    pthread_mutex_t lock; // taken before stripes, see struct Game
+    pthread_cond_t wake; // a slot wants a chunk, or stop
+    pthread_cond_t staged; // the loader filled a slot
+};
 
 /**
- * Represents entire game. Contains data of defender, attacker, and city.
+ * Represents entire game. Contains data of defender, attacker, and city,
+ * and every other piece of state of one match, so a process can run
+ * several.
  */
 struct Game {
     struct Defender *defender;
     struct Attacker *attacker;
-    int *layout;
+    int height; // of curses window or headless board, see HEIGHT
+    int width;
+    // lock order: shieldLock, then stream lock, then stripes, then
+    // skylineLock, then napLock, then the lock of a missile queue
+    // stripes[i] guards grid, sky, layout and dirty rows of columns
+    // x / STRIPE_COLS % NSTRIPES; viewX only changes while all stripes
+    // are held
+    struct Lock stripes[NSTRIPES];
+    struct Lock shieldLock; // moving the shield
+    uint64_t seed; // every thread's random stream derives from it
+    _Bool lockstep; // tick engine launches missiles and applies shield moves
+    _Bool fastForward; // tick engine runs ticks back to back
+    FILE *recordFile; // replay log being written, see --record
+    unsigned recordTick; // tick of the last event written to recordFile
+    int recordShield; // shield of the last move written to recordFile
+    struct Replay replay; // log being played back, see --replay
+    uint8_t *layout; // height of each city col
     int size;
     int cap;
-    int tallest;
-    _Bool gameOver;
+    int tallest; // as loaded, fixes the shield row
+    uint8_t *skyline; // max segment tree of layout, root at 1; skylineLock
+    int skylineLeaves; // power of two, leaf of col x at skylineLeaves + x
+    pthread_mutex_t skylineLock; // for a city hit, see lock order
+    atomic_int roof; // tallest building standing, see updateRoof
+    int worldWidth; // columns simulated, at least the terminal width
+    char *endless; // endless=... setting, see openStream
+    struct Stream *stream; // chunks of an endless city, or NULL
+    atomic_int viewX; // world col shown at left edge of terminal
+    char *grid;
+    uint32_t *sky; // number of missiles in each world cell
+    unsigned char *cover; // number of shields over each world col; shieldLock
+    atomic_ullong *shielded; // bitset of world cols with cover, see moveShield
+    atomic_ullong *blasts; // ROW_WORDS words per row, bit set at each '*'
+    char *text; // messages, in terminal coordinates; render thread only
+    struct Message *messages; // ring of MSG_SLOTS, see postMessage
+    atomic_uint msgTail; // next ring position to post at
+    unsigned msgHead; // next ring position to lay out; render thread only
+    int logRow; // next row of the message log; render thread only
+    int *dirtyTop; // rows dirtyTop to dirtyBottom of each world col need
+    int *dirtyBottom; // redrawing; clean when top > bottom
+    char *settings; // key=value lines from config file
+    int fps;
+    atomic_bool renderStop;
+    atomic_bool gameOver;
+    atomic_bool stopped; // quit or signalled, see stopGame
+    pthread_mutex_t napLock; // guards napWake and queue, see nap
+    pthread_cond_t napWake; // on CLOCK_MONOTONIC, broadcast as the game ends
+    struct MissileQueue *queue; // of the attack thread while open; napLock
+    atomic_bool overlay; // stats shown on message row 1
+};
+
+/**
+ * Header of a precompiled level file. It is followed by settingsLen bytes
+ * of key=value lines, then by columns packed heights of heightBytes bytes
+ * each, starting on a heightBytes boundary. Integers are in host order.
+ */
+struct LevelHeader {
+    char magic[4];
+    uint8_t version;
+    uint8_t heightBytes;
+    uint16_t settingsLen;
+    int32_t totalMissiles;
+    uint32_t columns;
+    int32_t tallest;
+    char defender[NAME_MAX_LEN + 1];
+    char attacker[NAME_MAX_LEN + 1];
+};
+
+/**
+ * Shield moves read by an input thread, waiting to be applied. Only one
+ * thread queues moves and only one takes them, so the producer writes
+ * just tail and the consumer just head, and neither takes a lock.
+ */
+struct KeyQueue {
+    signed char dir[KEY_QUEUE_LEN]; // -1 left, 1 right
+    atomic_uint head; // next move to take
+    atomic_uint tail; // next free entry
+};
+
+/**
+ * One shield of the defender, with its own queue of moves
+ */
+struct Shield {
+    atomic_int x; // world col of left end
+    struct KeyQueue keys;
 };
 
 /**
- * Represents defender
+ * Represents defender. Every shield flies on the same row, and
+ * game->cover counts the shields over each column of it and
+ * game->shielded has a bit set for each column with any.
  */
 struct Defender {
-    _Bool *gameOver;
+    struct Game *game; // match it defends
+    atomic_bool *gameOver;
+    WINDOW *input;
+    int wake[2]; // pipe written once when the game ends
+    struct Shield shields[MAX_SHIELDS];
+    int nshields;
+    pthread_mutex_t keysLock; // only for waiting on keysReady
+    pthread_cond_t keysReady; // uses the monotonic clock
     char *name;
     const char *shield;
     int shieldY;
-    int shieldX;
+    int duration;
 };
 
 /**
  * Represents attacker
  */
 struct Attacker {
-    _Bool *gameOver;
+    struct Game *game; // match it attacks
+    atomic_bool *gameOver;
     char *name;
     int totalMissiles;
+    int workers;
+    int inflight;
+    _Bool tickEngine;
+    int tickMs;
+    int rate; // missiles per second, 0 for random delays
+    int profile;
+    int periodMs; // of ramp and spike profiles
 };
 
 /**
- * Represents a missile
+ * Represents a missile, one slot of the missile pool. A handle holds the
+ * slot's generation above its index; freeing a slot bumps the generation
+ * so every handle to the missile that landed goes stale.
  */
 struct Missile {
     int x;
     int y;
-    char c;
+    int speed;
+    int wait;
+    struct timespec due;
+    uint32_t handle; // current handle of this slot
+    uint32_t next; // handle of next missile in list
+};
+
+/**
+ * Missiles in flight in the tick engine, stored as parallel arrays so the
+ * step kernel can work on a batch of them with vector instructions
+ */
+struct Swarm {
+    int n;
+    int *x;
+    int *y;
+    int *speed;
+    int *wait; // ticks until next move
+    int *event; // STEP_* result of last step kernel run
+    uint32_t *handle;
+};
+
+/**
+ * Chase-Lev work-stealing deque of task numbers. Its owner pushes and
+ * takes at the bottom; other workers steal from the top.
+ */
+struct Deque {
+    _Alignas(64) atomic_long top;
+    atomic_long bottom;
+    atomic_int *tasks; // ring of cap tasks
+    long cap;
+};
+
+/**
+ * Workers sharing the missile moves of each tick. A task is every move in
+ * one block of STRIPE_COLS columns, which holds one stripe lock. A move
+ * only changes its own column and only reads the shield, so tasks never
+ * conflict; the tick engine resolves landings and launches alone once
+ * every task is done.
+ */
+struct Crew {
+    struct Game *game;
+    int size; // workers, including the tick engine thread
+    atomic_int ids; // worker numbers handed out to helpers
+    struct Deque *deques; // one per worker
+    atomic_int *rings; // tasks of every deque
+    pthread_t *helpers;
+    pthread_mutex_t lock;
+    pthread_cond_t go; // a tick's tasks are ready, or stop is set
+    pthread_cond_t idle; // helpers are done with the tick's tasks
+    unsigned generation; // ticks handed to helpers
+    int busy; // helpers still working on this tick
+    _Bool stop;
+    atomic_int remaining; // tasks of this tick not finished
+    struct Swarm *swarm;
+    unsigned tick;
+    unsigned *razed; // tick of the last explosion in each world col
+    int nblocks;
+    int *count; // due moves in each block
+    int ntasks;
+    int *first; // moves of task t are order[first[t]] to order[first[t+1]]
+    int *order; // indexes of due missiles, by block
+};
+
+/**
+ * Step kernel: counts down the wait of every missile in a swarm and sets
+ * its event for this tick
+ */
+typedef void StepKernel(struct Swarm *swarm);
+
+StepKernel *stepKernel; // kernel of every tick engine, see pickStep
+
+/**
+ * Queue of launched missiles, shared by attacker and missile workers. It
+ * owns the pool of limit missiles; when the pool is empty, the attacker
+ * waits for a slot to be freed.
+ */
+struct MissileQueue {
+    struct Game *game;
+    uint32_t head;
+    uint32_t tail;
+    struct Missile *slots;
+    uint32_t free; // first free slot, linked through next
+    int limit;
+    _Bool closed;
+    atomic_int workerIds; // random streams handed out to workers
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+};
+
+/**
+ * Tick engine state kept between ticks, so one thread can run the engines
+ * of several matches in turn
+ */
+struct Engine {
+    struct MissileQueue *q;
+    StepKernel *step;
+    struct Swarm swarm;
+    uint32_t *landed; // handles of missiles that landed this tick
+    struct Crew crew;
+    _Bool ready; // swarm allocated and crew started
+    long tickMs;
+    unsigned tick;
+    _Bool ended; // lockstep: no more launches
+    unsigned nextLaunch;
+    long long launchNs; // game time of next launch, for a rate
+    unsigned eventTick;
+    int event;
+    _Bool pending; // replay event not yet applied
 };
 
+/**
+ * Get nanoseconds elapsed from start to end
+ *
+ * @param start earlier time
+ * @param end later time
+ * @return elapsed nanoseconds
+ */
+unsigned long long elapsedNs(const struct timespec *start,
+		const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+	    end->tv_nsec - start->tv_nsec;
+}
+
+/**
+ * Advance ts by ns nanoseconds
+ *
+ * @param ts timespec to advance
+ * @param ns nanoseconds to add
+ */
+void addTime(struct timespec *ts, long ns) {
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec += ns % 1000000000;
+    if (ts->tv_nsec >= 1000000000) {
+	ts->tv_sec++;
+	ts->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ * Set ts to the current monotonic time plus ms milliseconds of game time,
+ * shortened by speedup
+ *
+ * @param ts timespec to set
+ * @param ms milliseconds from now
+ */
+void deadline(struct timespec *ts, long ms) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    addTime(ts, ms * 1000000 / speedup);
+}
+
+/**
+ * Get the most memory this process has held resident
+ *
+ * @return peak resident set size in kilobytes, 0 if unknown
+ */
+long peakRss(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1) return 0;
+    return usage.ru_maxrss;
+}
+
+/**
+ * Record a duration in a histogram
+ *
+ * @param h histogram to add to
+ * @param ns duration in nanoseconds
+ */
+void histAdd(struct Histogram *h, unsigned long long ns) {
+    int i = ns;
+    if (ns >= HIST_SUB) {
+	int msb = 63 - __builtin_clzll(ns);
+	i = (msb - 3) * HIST_SUB + (ns >> (msb - 4)) % HIST_SUB;
+    }
+    atomic_fetch_add_explicit(h->count + i, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->n, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, ns, memory_order_relaxed);
+}
+
+/**
+ * Estimate a percentile of the durations in a histogram
+ *
+ * @param h histogram to query
+ * @param p percentile, 0 to 100
+ * @return approximate duration in nanoseconds
+ */
+unsigned long long histPercentile(const struct Histogram *h, double p) {
+    unsigned long long rank = h->n * p / 100, seen = 0;
+    for (int i = 0; i < 64 * HIST_SUB; i++) {
+	seen += h->count[i];
+	if (seen > rank) {
+	    if (i < HIST_SUB) return i;
+	    return (unsigned long long) (HIST_SUB + i % HIST_SUB) <<
+		    (i / HIST_SUB - 1);
+	}
+    }
+    return 0;
+}
+
+/**
+ * Print mean and p99 of a histogram in microseconds
+ *
+ * @param name label of measurement
+ * @param h histogram to print
+ */
+void histPrint(const char *name, const struct Histogram *h) {
+    if (h->n == 0) return;
+    printf("%s: mean %.2f us, p99 %.2f us (%llu samples)\n", name,
+		    h->total / 1000.0 / h->n, histPercentile(h, 99) / 1000.0,
+		    h->n);
+}
+
+/**
+ * Get the next number from this thread's random stream
+ *
+ * @return uniformly distributed 32 bit number
+ */
+uint32_t rngNext(void) {
+    uint64_t old = rng.state;
+    rng.state = old * 6364136223846793005ULL + rng.inc;
+    uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+    uint32_t rot = old >> 59;
+    return (xorshifted >> rot) | (xorshifted << (-rot & 31));
+}
+
+/**
+ * Get a random number in [0, n) from this thread's random stream
+ *
+ * @param n exclusive upper bound, > 0
+ * @return random number
+ */
+int rngRange(int n) {
+    return (uint64_t) rngNext() * n >> 32;
+}
+
+/**
+ * Seed this thread's random stream from the global seed. Threads given
+ * different stream numbers draw independent sequences, and the same seed
+ * and stream always give the same sequence.
+ *
+ * @param stream stream number of thread
+ */
+void seedThread(uint64_t stream) {
+    rng.state = 0;
+    rng.inc = stream << 1 | 1;
+    rngNext();
+    rng.state += game->seed;
+    rngNext();
+}
+
+/**
+ * Give this thread its own counters. Call first in every thread.
+ *
+ * @param role name of thread in the stats dump
+ */
+void countThread(const char *role) {
+    int n = atomic_fetch_add(&nthreads, 1);
+    mine = counters + ((n < MAX_THREADS) ? n: MAX_THREADS - 1);
+    if (n < MAX_THREADS) mine->role = role;
+}
+
+/**
+ * Add to one of this thread's counters
+ *
+ * @param counter counter of this thread
+ * @param n amount to add
+ */
+void tally(atomic_ullong *counter, unsigned long long n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+/**
+ * Sum the counters of every thread
+ *
+ * @param total set to the sums; its role is left NULL
+ */
+void sumCounters(struct Counters *total) {
+    int n = atomic_load(&nthreads);
+    if (n > MAX_THREADS) n = MAX_THREADS;
+    memset(total, 0, sizeof *total);
+    for (int i = 0; i < n; i++) {
+	total->launched += counters[i].launched;
+	total->blocked += counters[i].blocked;
+	total->cityHits += counters[i].cityHits;
+	total->lockWaits += counters[i].lockWaits;
+	total->lockWaitNs += counters[i].lockWaitNs;
+	total->refreshes += counters[i].refreshes;
+	total->refreshNs += counters[i].refreshNs;
+	total->netBytes += counters[i].netBytes;
+    }
+}
+
+/**
+ * Acquire a lock and start timing how long it is held. Time spent
+ * waiting for a taken lock is counted.
+ *
+ * @param l lock to acquire
+ */
+void lock(struct Lock *l) {
+    if (pthread_mutex_trylock(&l->mutex) != 0) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&l->mutex);
+	clock_gettime(CLOCK_MONOTONIC, &l->locked);
+	tally(&mine->lockWaits, 1);
+	tally(&mine->lockWaitNs, elapsedNs(&start, &l->locked));
+	return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &l->locked);
+}
+
+/**
+ * Record how long a lock was held and release it
+ *
+ * @param l lock to release
+ */
+void unlock(struct Lock *l) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    histAdd(&bench.lockHold, elapsedNs(&l->locked, &now));
+    pthread_mutex_unlock(&l->mutex);
+}
+
+/**
+ * Get the lock stripe guarding a column of the grid and layout
+ *
+ * @param x col of grid
+ * @return lock of stripe containing x
+ */
+struct Lock *stripeOf(int x) {
+    return game->stripes + x / STRIPE_COLS % NSTRIPES;
+}
+
+/**
+ * End the game and wake the threads that sleep until it ends: every nap,
+ * and the input thread through the wake pipe. Caller must not hold the
+ * lock of a missile queue.
+ */
+void endGame(void) {
+    pthread_mutex_lock(&game->napLock);
+    game->gameOver = 1;
+    pthread_cond_broadcast(&game->napWake);
+    pthread_mutex_unlock(&game->napLock);
+    if (game->defender->wake[1] != -1) {
+	while (write(game->defender->wake[1], "", 1) == -1 && errno == EINTR);
+    }
+}
+
+/**
+ * Stop the game at once, on a quit or a signal. Unlike a game that runs
+ * out of missiles or time, missiles in flight are dropped instead of
+ * flown until they land, and the missile queue is closed so no thread
+ * waits on it for long; every thread exits within milliseconds. A run
+ * being recorded is the exception: its engine flies the last missiles
+ * out at full speed, as the replay of its log will.
+ */
+void stopGame(void) {
+    endGame();
+    pthread_mutex_lock(&game->napLock);
+    game->stopped = 1;
+    pthread_cond_broadcast(&game->napWake);
+    struct MissileQueue *q = game->queue;
+    if (q) {
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->ready);
+	pthread_cond_broadcast(&q->space);
+	pthread_mutex_unlock(&q->lock);
+    }
+    pthread_mutex_unlock(&game->napLock);
+}
+
+/**
+ * Sleep until a deadline, or until a flag set by endGame or stopGame
+ *
+ * @param until deadline on the monotonic clock
+ * @param flag game->gameOver or game->stopped
+ * @return 0 if woken by the flag
+ *         1 if the deadline passed
+ */
+_Bool nap(const struct timespec *until, atomic_bool *flag) {
+    pthread_mutex_lock(&game->napLock);
+    int err = 0;
+    while (!*flag && err != ETIMEDOUT) {
+	err = pthread_cond_timedwait(&game->napWake, &game->napLock, until);
+    }
+    _Bool woken = *flag;
+    pthread_mutex_unlock(&game->napLock);
+    return !woken;
+}
+
 /**
  * Free mem alloc'd for defender
  *
@@ -75,6 +822,10 @@ struct Missile {
 void destroyDefender(struct Defender *defender) {
     if (defender) {
         if (defender->name) free(defender->name);
+        if (defender->input) delwin(defender->input);
+        if (defender->wake[0] != -1) close(defender->wake[0]);
+        if (defender->wake[1] != -1) close(defender->wake[1]);
+        pthread_cond_destroy(&defender->keysReady);
         free(defender);
     }
 }
@@ -91,6 +842,23 @@ void destroyAttacker(struct Attacker *attacker) {
     }
 }
 
+/**
+ * Free the ring of an endless city once its loader has stopped, and close
+ * the level file it streamed from
+ *
+ * @param stream stream to free
+ */
+void destroyStream(struct Stream *stream) {
+    if (stream->fd != -1) close(stream->fd);
+    if (stream->slots) free(stream->slots[0].heights);
+    free(stream->slots);
+    free(stream->city);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->wake);
+    pthread_cond_destroy(&stream->staged);
+    free(stream);
+}
+
 /**
  * Free mem alloc'd for game
  *
@@ -99,6 +867,21 @@ void destroyAttacker(struct Attacker *attacker) {
 void destroyGame(struct Game *game) {
     if (game) {
         if (game->layout) free(game->layout);
+#ifndef BOARD_WIDTH
+        if (game->grid) free(game->grid);
+        if (game->sky) free(game->sky);
+        if (game->text) free(game->text);
+        if (game->messages) free(game->messages);
+        if (game->dirtyTop) free(game->dirtyTop);
+        if (game->dirtyBottom) free(game->dirtyBottom);
+        if (game->cover) free(game->cover);
+        if (game->shielded) free(game->shielded);
+        if (game->blasts) free(game->blasts);
+        if (game->skyline) free(game->skyline);
+#endif
+        if (game->settings) free(game->settings);
+	if (game->endless) free(game->endless);
+	if (game->stream) destroyStream(game->stream);
 	if (game->defender) destroyDefender(game->defender);
         if (game->attacker) destroyAttacker(game->attacker);
         free(game);
@@ -106,425 +889,4117 @@ void destroyGame(struct Game *game) {
 }
 
 /**
- * Convert string to integer
+ * Convert the characters in [str, end) to an integer in a single pass
  *
- * @param str string to convert
+ * @param str first character
+ * @param end one past last character
  * @param val pointer to int storing result of function
  * @return 0 unsuccessful conversion
  *         1 successful conversion
  */
-int strInt(char *str, int *val) {
+int parseInt(const char *str, const char *end, int *val) {
+    _Bool neg = str < end && *str == '-';
+    const char *p = str + neg;
+    if (p == end) return 0;
     int sum = 0;
-    for (size_t i = 0; i < strlen(str); i++) {
-	if (i == 0 && str[i] == '-') continue;
-
-	int digit = str[i] - '0';
+    for (; p < end; p++) {
+	int digit = *p - '0';
 	if (digit < 0 || digit > 9) return 0;
 	if (sum != 0 && (INT_MAX - digit) / sum < 10) return 0;
 	sum = sum * 10 + digit;
     }
-    if (str[0] == '\0' || (str[0] == '-' && str[1] == '\0')) return 0;
-    *val = (str[0] == '-') ? -sum: sum;
+    *val = (neg) ? -sum: sum;
     return 1;
 }
 
 /**
- * Process config file and store data in Game struct
+ * Convert string to integer
  *
- * @param filename the config file
- * @return created Game struct
+ * @param str string to convert
+ * @param val pointer to int storing result of function
+ * @return 0 unsuccessful conversion
+ *         1 successful conversion
  */
-struct Game *createGame(char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL) {
-	perror(filename);
-	exit(EXIT_FAILURE);
+int strInt(char *str, int *val) {
+    return parseInt(str, str + strlen(str), val);
+}
+
+/**
+ * Find the line starting at *p in a config file buffer and advance *p to
+ * the next line
+ *
+ * @param p start of line, set to start of next line
+ * @param end end of buffer
+ * @return end of line, excluding '\n'
+ */
+const char *nextLine(const char **p, const char *end) {
+    const char *eol = memchr(*p, '\n', end - *p);
+    if (eol == NULL) {
+	*p = end;
+	return end;
     }
+    *p = eol + 1;
+    return eol;
+}
 
-    struct Game *game = malloc(sizeof *game);
-    if (game == NULL) {
-	perror("createGame");
-	exit(EXIT_FAILURE);
+/**
+ * Apply a key=value setting from config file to game
+ *
+ * @param game game to configure
+ * @param str setting to apply, modified in place
+ * @return 0 unknown key or invalid value
+ *         1 successful
+ */
+int parseSetting(struct Game *game, char *str) {
+    char *val = strchr(str, '=');
+    *val++ = '\0';
+    int n;
+    if (strcmp(str, "workers") == 0) {
+	if (!strInt(val, &n) || n < 1) return 0;
+	game->attacker->workers = n;
+    } else if (strcmp(str, "inflight") == 0) {
+	if (!strInt(val, &n) || n < 1) return 0;
+	game->attacker->inflight = n;
+    } else if (strcmp(str, "engine") == 0) {
+	if (strcmp(val, "tick") == 0) game->attacker->tickEngine = 1;
+	else if (strcmp(val, "threads") == 0) game->attacker->tickEngine = 0;
+	else return 0;
+    } else if (strcmp(str, "tick") == 0) {
+	if (!strInt(val, &n) || n < 1) return 0;
+	game->attacker->tickMs = n;
+    } else if (strcmp(str, "fps") == 0) {
+	if (!strInt(val, &n) || n < 1) return 0;
+	game->fps = n;
+    } else if (strcmp(str, "shields") == 0) {
+	if (!strInt(val, &n) || n < 1 || n > MAX_SHIELDS) return 0;
+	game->defender->nshields = n;
+    } else if (strcmp(str, "rate") == 0) {
+	if (!strInt(val, &n) || n < 1) return 0;
+	game->attacker->rate = n;
+    } else if (strcmp(str, "profile") == 0) {
+	if (strcmp(val, "steady") == 0) game->attacker->profile = PROFILE_STEADY;
+	else if (strcmp(val, "ramp") == 0) game->attacker->profile = PROFILE_RAMP;
+	else if (strcmp(val, "spike") == 0) {
+	    game->attacker->profile = PROFILE_SPIKE;
+	} else return 0;
+    } else if (strcmp(str, "period") == 0) {
+	if (!strInt(val, &n) || n < 1 || n > INT_MAX / 1000) return 0;
+	game->attacker->periodMs = n * 1000;
+    } else if (strcmp(str, "endless") == 0) {
+	if (*val == '\0') return 0;
+	free(game->endless);
+	game->endless = strdup(val);
+	if (game->endless == NULL) {
+	    perror("createGame");
+	    exit(EXIT_FAILURE);
+	}
+    } else {
+	return 0;
     }
-    struct Defender *defender = malloc(sizeof *defender);
-    if (defender == NULL) {
+    return 1;
+}
+
+/**
+ * Apply a key=value setting from a config file buffer and keep a copy of
+ * it in game->settings
+ *
+ * @param game game to configure
+ * @param str start of setting
+ * @param n length of setting
+ * @return 0 unknown key or invalid value
+ *         1 successful
+ */
+int addSetting(struct Game *game, const char *str, size_t n) {
+    size_t have = (game->settings) ? strlen(game->settings): 0;
+    char *settings = realloc(game->settings, have + n + 2);
+    char *setting = strndup(str, n);
+    if (settings == NULL || setting == NULL) {
 	perror("createGame");
 	exit(EXIT_FAILURE);
     }
-    struct Attacker *attacker = malloc(sizeof *attacker);
-    if (attacker == NULL) {
-        perror("createGame");
-        exit(EXIT_FAILURE);
+    game->settings = settings;
+    memcpy(settings + have, str, n);
+    strcpy(settings + have + n, "\n");
+    int retval = parseSetting(game, setting);
+    if (!retval) fprintf(stderr, "Error: invalid setting '%s'.\n", setting);
+    free(setting);
+    return retval;
+}
+
+/**
+ * Parse a text config file. The buffer is scanned twice: once to count
+ * the city columns so the layout is allocated exactly once, then once to
+ * parse it.
+ *
+ * @param game game to store data in
+ * @param text contents of config file
+ * @param len length of text
+ * @return 0 if config file is invalid
+ *         1 if successful
+ */
+int readConfig(struct Game *game, const char *text, size_t len) {
+    struct Defender *defender = game->defender;
+    struct Attacker *attacker = game->attacker;
+    const char *end = text + len;
+
+    // first pass: count tokens on cityscape lines
+    size_t columns = 0;
+    int line = 0;
+    for (const char *p = text; p < end; ) {
+	const char *str = p;
+	const char *eol = nextLine(&p, end);
+	if (*str == '#') continue;
+	if (line >= 3 && memchr(str, '=', eol - str)) continue;
+	if (line++ < 3) continue;
+	for (const char *c = str; c < eol; c++) {
+	    if (*c != ' ' && (c == str || c[-1] == ' ')) columns++;
+	}
     }
-    
-    game->gameOver = 0;
-    game->defender = defender;
-    game->attacker = attacker;
-    game->cap = 10;
-    game->size = 0;
-    game->layout = malloc(sizeof *game->layout * game->cap);
+    game->cap = (columns > 0) ? columns: 1;
+    game->layout = malloc(sizeof *game->layout * game->cap + LAYOUT_PAD);
     if (game->layout == NULL) {
         perror("createGame");
         exit(EXIT_FAILURE);
     }
-    game->tallest = 0;
-    
-    defender->gameOver = &game->gameOver;
-    defender->name = NULL;
-    defender->shield = "#####";
-
-    attacker->gameOver = &game->gameOver;
-    attacker->name = NULL;
 
-    int line = 0;
-    char *str = NULL;
-    size_t len = 0;
-    ssize_t char_read;
-    while ((char_read = getline(&str, &len, fp)) > 0) {
-	if (str[0] == '#') continue;
-	str[strlen(str) - 1] = '\0'; // strip '\n'
-        if (line == 0) defender->name = strndup(str, 80);
-	else if (line == 1) attacker->name = strndup(str, 80);
-	else if (line == 2) {
-	    int retval = strInt(str, &attacker->totalMissiles);
+    // second pass: parse
+    line = 0;
+    for (const char *p = text; p < end; ) {
+	const char *str = p;
+	const char *eol = nextLine(&p, end);
+	size_t n = eol - str;
+	if (*str == '#') continue;
+        if (line == 0) {
+	    defender->name = strndup(str, (n < NAME_MAX_LEN) ? n: NAME_MAX_LEN);
+	} else if (line == 1) {
+	    attacker->name = strndup(str, (n < NAME_MAX_LEN) ? n: NAME_MAX_LEN);
+	} else if (line == 2) {
+	    int retval = parseInt(str, eol, &attacker->totalMissiles);
 	    if (retval == 0 || attacker->totalMissiles < 0) {
 	        if (retval == 0) fprintf(stderr,
 				"Error: missing missile specification.\n");
 	        else fprintf(stderr, "Error: missile specification < 0.\n");
-		free(str);
-		fclose(fp);
-		destroyGame(game);
-		exit(EXIT_FAILURE);
+		return 0;
 	    }
 	    if (attacker->totalMissiles == 0) attacker->totalMissiles = -1;
+	} else if (memchr(str, '=', n) != NULL) {
+	    if (!addSetting(game, str, n)) return 0;
+	    continue; // settings do not count as layout lines
 	} else {
-	    char *token = strtok(str, " ");
-	    while (token != NULL) {
-		if (game->size >= game->cap - 1) {
-		    game->cap *= 2;
-		    game->layout = realloc(game->layout,
-				    sizeof *game->layout * game->cap);
-		    if (game->layout == NULL) {
-		        perror("createGame");
-		        exit(EXIT_FAILURE);
-	            }
+	    const char *token = str;
+	    while (token < eol) {
+		const char *sp = memchr(token, ' ', eol - token);
+		if (sp == NULL) sp = eol;
+		int tall;
+		if (sp > token && parseInt(token, sp, &tall)) {
+		    if (tall > MAX_TALL) {
+			fprintf(stderr, "Error: building height (%d) > %d.\n",
+					tall, MAX_TALL);
+			return 0;
+		    }
+		    // negative heights draw nothing, same as 0
+		    game->layout[game->size++] = (tall < 0) ? 0: tall;
+		    if (tall > game->tallest) game->tallest = tall;
 		}
+		token = sp + 1;
+	    }
+	}
+	line++;
+    }
+    if ((line > 0 && defender->name == NULL) ||
+		    (line > 1 && attacker->name == NULL)) {
+	perror("createGame");
+	exit(EXIT_FAILURE);
+    }
+    if (line < 4) {
+	if (line == 0) fprintf(stderr, "Error: missing defender name.\n");
+	else if (line == 1) fprintf(stderr, "Error: missing attacker name.\n");
+	else if (line == 2) fprintf(stderr,
+			"Error: missing missile specification.\n");
+	else fprintf(stderr, "Error: missing city layout.\n");
+	return 0;
+    }
+    return 1;
+}
+
+/**
+ * Check the header of a precompiled level file
+ *
+ * @param h header of level file
+ * @param len length of level file
+ * @return offset of the packed heights
+ *         0 if level file is invalid
+ */
+size_t levelHeights(const struct LevelHeader *h, size_t len) {
+    size_t hb = h->heightBytes;
+    size_t heights = sizeof *h + h->settingsLen;
+    if (hb != 0) heights = (heights + hb - 1) / hb * hb;
+    if (h->version != 1 || (hb != 1 && hb != 2) || h->columns == 0 ||
+		    h->totalMissiles < 0 || h->tallest < 0 ||
+		    h->tallest >= 1 << (8 * hb) ||
+		    heights + (size_t) h->columns * hb > len) {
+	return 0;
+    }
+    return heights;
+}
+
+/**
+ * Check whether a file is a precompiled level file: its header has the
+ * magic, a known version, and sizes that fit the file. Anything else,
+ * even text that happens to start with the magic, is a config file.
+ *
+ * @param data contents of file
+ * @param len length of file
+ * @return 1 if data is a level file
+ */
+_Bool isLevel(const char *data, size_t len) {
+    struct LevelHeader h;
+    if (len < sizeof h) return 0;
+    memcpy(&h, data, sizeof h);
+    return memcmp(h.magic, LEVEL_MAGIC, sizeof h.magic) == 0 &&
+	    levelHeights(&h, len) != 0;
+}
+
+/**
+ * Load a precompiled level file. Nothing but the settings is parsed; the
+ * packed heights are copied straight into the layout.
+ *
+ * @param game game to store data in
+ * @param data contents of level file
+ * @param len length of data
+ * @return 0 if level file is invalid
+ *         1 if successful
+ */
+int readLevel(struct Game *game, const char *data, size_t len) {
+    struct LevelHeader h;
+    memcpy(&h, data, sizeof h);
+    size_t heights = levelHeights(&h, len);
+    if (heights == 0) {
+	fprintf(stderr, "Error: corrupt level file.\n");
+	return 0;
+    }
+    game->defender->name = strndup(h.defender, NAME_MAX_LEN);
+    game->attacker->name = strndup(h.attacker, NAME_MAX_LEN);
+    if (h.tallest > MAX_TALL) {
+	fprintf(stderr, "Error: building height (%d) > %d.\n", h.tallest,
+			MAX_TALL);
+	return 0;
+    }
+    game->layout = malloc(sizeof *game->layout * h.columns + LAYOUT_PAD);
+    if (game->defender->name == NULL || game->attacker->name == NULL ||
+		    game->layout == NULL) {
+	perror("createGame");
+	exit(EXIT_FAILURE);
+    }
+    game->attacker->totalMissiles = (h.totalMissiles == 0) ? -1:
+	    h.totalMissiles;
+    const char *p = data + sizeof h;
+    const char *end = p + h.settingsLen;
+    while (p < end) {
+	const char *str = p;
+	const char *eol = nextLine(&p, end);
+	if (eol > str && !addSetting(game, str, eol - str)) return 0;
+    }
+    // the board is sized by the header's tallest, so hold every height to it
+    const unsigned char *packed = (const unsigned char *) data + heights;
+    for (uint32_t i = 0; i < h.columns; i++) {
+	uint16_t tall = packed[i];
+	if (h.heightBytes == 2) memcpy(&tall, packed + 2 * i, 2);
+	if (tall > h.tallest) {
+	    fprintf(stderr, "Error: corrupt level file.\n");
+	    return 0;
+	}
+	game->layout[i] = tall;
+    }
+    game->size = game->cap = h.columns;
+    game->tallest = h.tallest;
+    return 1;
+}
+
+/**
+ * Write a game's config as a precompiled level file
+ *
+ * @param game game loaded from a config file
+ * @param filename level file to write
+ * @return 0 if game cannot be packed or file cannot be written
+ *         1 if successful
+ */
+int writeLevel(struct Game *game, const char *filename) {
+    struct LevelHeader h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, LEVEL_MAGIC, sizeof h.magic);
+    h.version = 1;
+    h.heightBytes = 1; // layout heights are bytes already
+    size_t settingsLen = (game->settings) ? strlen(game->settings): 0;
+    if (settingsLen > UINT16_MAX) {
+	fprintf(stderr, "Error: config cannot be packed.\n");
+	return 0;
+    }
+    h.settingsLen = settingsLen;
+    h.totalMissiles = (game->attacker->totalMissiles < 0) ? 0:
+	    game->attacker->totalMissiles;
+    h.columns = game->size;
+    h.tallest = (game->tallest < 0) ? 0: game->tallest;
+    strncpy(h.defender, game->defender->name, NAME_MAX_LEN);
+    strncpy(h.attacker, game->attacker->name, NAME_MAX_LEN);
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+	perror(filename);
+	return 0;
+    }
+    fwrite(&h, sizeof h, 1, fp);
+    if (settingsLen > 0) fwrite(game->settings, settingsLen, 1, fp);
+    fwrite(game->layout, sizeof *game->layout, game->size, fp);
+    int failed = ferror(fp);
+    if (fclose(fp) != 0 || failed) {
+	perror(filename);
+	return 0;
+    }
+    return 1;
+}
+
+/**
+ * Fold bytes into an FNV-1a hash
+ *
+ * @param hash hash so far, 2166136261 to start
+ * @param data bytes to add
+ * @param len number of bytes
+ * @return new hash
+ */
+uint32_t fnv1a(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+/**
+ * Open the stream of an endless city. endless=generate goes on with
+ * buildings generated from the seed; any other value names a level file
+ * whose columns go on after the config's city, over and over. Only the
+ * header of the level file is read here; its columns are read a chunk at
+ * a time as play reaches them.
+ *
+ * @param game game whose city goes on
+ * @return 0 if the level file is invalid or this build has no endless mode
+ *         1 if successful
+ */
+int openStream(struct Game *game) {
+#ifdef BOARD_WIDTH
+    (void) game;
+    fprintf(stderr, "Error: this build has no endless mode.\n");
+    return 0;
+#else
+    struct Stream *stream = calloc(1, sizeof *stream);
+    if (stream == NULL) {
+	perror("createGame");
+	exit(EXIT_FAILURE);
+    }
+    game->stream = stream;
+    stream->fd = -1;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->wake, NULL);
+    pthread_cond_init(&stream->staged, NULL);
+    if (strcmp(game->endless, "generate") == 0) return 1;
+    stream->fd = open(game->endless, O_RDONLY);
+    struct stat st;
+    if (stream->fd == -1 || fstat(stream->fd, &st) == -1) {
+	perror(game->endless);
+	return 0;
+    }
+    struct LevelHeader h;
+    if (pread(stream->fd, &h, sizeof h, 0) != sizeof h ||
+		    memcmp(h.magic, LEVEL_MAGIC, 4) != 0 ||
+		    (stream->heightsAt = levelHeights(&h, st.st_size)) == 0) {
+	fprintf(stderr, "Error: %s is not a level file.\n", game->endless);
+	return 0;
+    }
+    stream->heightBytes = h.heightBytes;
+    stream->columns = h.columns;
+    stream->tallest = h.tallest;
+    // replays check the file by its size, header and first columns
+    unsigned char first[CHUNK_COLS * 2];
+    size_t bytes = (size_t) ((h.columns < CHUNK_COLS) ? h.columns:
+		    CHUNK_COLS) * h.heightBytes;
+    if (pread(stream->fd, first, bytes, stream->heightsAt) !=
+		    (ssize_t) bytes) {
+	perror(game->endless);
+	return 0;
+    }
+    uint64_t size = st.st_size;
+    stream->identity = fnv1a(fnv1a(fnv1a(2166136261u, &size, sizeof size),
+			    &h, sizeof h), first, bytes);
+    return 1;
+#endif
+}
+
+/**
+ * Process config file or precompiled level file and store data in Game
+ * struct. The file is mapped into memory and never copied.
+ *
+ * @param filename the config file
+ * @return created Game struct
+ */
+struct Game *createGame(char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+	perror(filename);
+	exit(EXIT_FAILURE);
+    }
+    size_t len = st.st_size;
+    const char *text = "";
+    if (len > 0) {
+	text = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (text == MAP_FAILED) {
+	    perror(filename);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    close(fd);
+
+    struct Game *game = malloc(sizeof *game);
+    if (game == NULL) {
+	perror("createGame");
+	exit(EXIT_FAILURE);
+    }
+    struct Defender *defender = malloc(sizeof *defender);
+    if (defender == NULL) {
+	perror("createGame");
+	exit(EXIT_FAILURE);
+    }
+    struct Attacker *attacker = malloc(sizeof *attacker);
+    if (attacker == NULL) {
+        perror("createGame");
+        exit(EXIT_FAILURE);
+    }
+    
+    game->gameOver = 0;
+    game->stopped = 0;
+    pthread_mutex_init(&game->napLock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&game->napWake, &attr);
+    game->queue = NULL;
+    game->defender = defender;
+    game->attacker = attacker;
+    game->height = DEFAULT_HEIGHT;
+    game->width = DEFAULT_WIDTH;
+    for (int i = 0; i < NSTRIPES; i++) {
+	pthread_mutex_init(&game->stripes[i].mutex, NULL);
+    }
+    pthread_mutex_init(&game->shieldLock.mutex, NULL);
+    game->seed = 0;
+    game->lockstep = 0;
+    game->fastForward = 0;
+    game->recordFile = NULL;
+    game->recordTick = 0;
+    game->recordShield = 0;
+    game->replay = (struct Replay) { .data = NULL };
+    game->layout = NULL;
+    game->cap = 0;
+    game->size = 0;
+    game->tallest = 0;
+    game->skyline = NULL;
+    game->skylineLeaves = 0;
+    pthread_mutex_init(&game->skylineLock, NULL);
+    game->roof = 0;
+    game->worldWidth = 0;
+    game->endless = NULL;
+    game->stream = NULL;
+    game->viewX = 0;
+    game->grid = NULL;
+    game->sky = NULL;
+    game->text = NULL;
+    game->messages = NULL;
+    game->msgTail = 0;
+    game->msgHead = 0;
+    game->logRow = LOG_TOP;
+    game->dirtyTop = NULL;
+    game->dirtyBottom = NULL;
+    game->cover = NULL;
+    game->shielded = NULL;
+    game->blasts = NULL;
+    game->settings = NULL;
+    game->fps = 30;
+    game->renderStop = 0;
+    game->overlay = 0;
+    
+    defender->game = game;
+    defender->gameOver = &game->gameOver;
+    defender->input = NULL;
+    defender->wake[0] = defender->wake[1] = -1;
+    for (int i = 0; i < MAX_SHIELDS; i++) {
+	defender->shields[i].x = 0;
+	defender->shields[i].keys.head = 0;
+	defender->shields[i].keys.tail = 0;
+    }
+    defender->nshields = 1;
+    pthread_mutex_init(&defender->keysLock, NULL);
+    pthread_cond_init(&defender->keysReady, &attr);
+    pthread_condattr_destroy(&attr);
+    defender->duration = 0;
+    defender->name = NULL;
+    static char shield[SHIELD_WIDTH + 1];
+    memset(shield, '#', SHIELD_WIDTH);
+    defender->shield = shield;
+
+    attacker->game = game;
+    attacker->gameOver = &game->gameOver;
+    attacker->name = NULL;
+    attacker->workers = 0;
+    attacker->inflight = 0;
+    attacker->tickEngine = 0;
+    attacker->tickMs = 10;
+    attacker->rate = 0;
+    attacker->profile = PROFILE_STEADY;
+    attacker->periodMs = 10000;
+
+    int retval;
+    if (isLevel(text, len)) {
+	retval = readLevel(game, text, len);
+    } else {
+	retval = readConfig(game, text, len);
+    }
+    if (len > 0) munmap((void *) text, len);
+    if (retval && game->endless) retval = openStream(game);
+    if (!retval) {
+	destroyGame(game);
+	exit(EXIT_FAILURE);
+    }
+    return game;
+}
+
+/**
+ * Get the leaves of a skyline tree over a city
+ *
+ * @param size columns of city
+ * @return smallest power of two at least size, and at least 1
+ */
+int skylineLeaves(int size) {
+    int leaves = 1;
+    while (leaves < size) leaves *= 2;
+    return leaves;
+}
+
+/**
+ * Build the skyline tree of a city: a max segment tree over the heights
+ * of its columns, so the tallest building standing is kept up to date in
+ * O(log n) as the city is hit. Missing leaves count as height 0.
+ *
+ * @param game game whose layout to index
+ */
+void buildSkyline(struct Game *game) {
+    int leaves = skylineLeaves(game->size);
+    game->skylineLeaves = leaves;
+    for (int i = 0; i < leaves; i++) {
+	game->skyline[leaves + i] = (i < game->size) ? game->layout[i]: 0;
+    }
+    for (int i = leaves - 1; i >= 1; i--) {
+	int l = game->skyline[2 * i], r = game->skyline[2 * i + 1];
+	game->skyline[i] = (l > r) ? l: r;
+    }
+    game->roof = game->skyline[1];
+}
+
+/**
+ * Fill heights with the columns of chunk n of an endless city: the
+ * config's city while it lasts, then the level file streamed, or
+ * buildings generated from the seed and n. Heights are kept to the
+ * tallest building of the config, which fixed the shield row.
+ *
+ * @param stream stream of city
+ * @param n chunk to fill
+ * @param heights CHUNK_COLS heights to fill
+ * @return 0 if the level file could not be read, or holds a building
+ *         taller than its header claims
+ *         1 if successful
+ */
+int fillChunk(struct Stream *stream, long n, uint8_t *heights) {
+    long col = n * CHUNK_COLS;
+    int i = 0;
+    for (; i < CHUNK_COLS && col + i < stream->citySize; i++) {
+	heights[i] = stream->city[col + i];
+    }
+    int tallest = (game->tallest < 2) ? 2: game->tallest;
+    while (stream->fd != -1 && i < CHUNK_COLS) {
+	uint32_t at = (col + i - stream->citySize) % stream->columns;
+	uint32_t len = CHUNK_COLS - i;
+	if (len > stream->columns - at) len = stream->columns - at;
+	unsigned char packed[CHUNK_COLS * 2];
+	size_t bytes = (size_t) len * stream->heightBytes;
+	if (pread(stream->fd, packed, bytes, stream->heightsAt +
+				(size_t) at * stream->heightBytes) !=
+			(ssize_t) bytes) {
+	    return 0;
+	}
+	for (uint32_t j = 0; j < len; j++, i++) {
+	    uint16_t h = packed[j];
+	    if (stream->heightBytes == 2) memcpy(&h, packed + 2 * j, 2);
+	    if (h > stream->tallest) {
+		errno = EBADMSG; // taller than its header claims
+		return 0;
+	    }
+	    heights[i] = (h > tallest) ? tallest: h;
+	}
+    }
+    if (i == CHUNK_COLS) return 1;
+    struct Rng saved = rng;
+    seedThread(CHUNK_STREAM + n);
+    _Bool gap = 0;
+    int tall = 2;
+    for (int run = 0; i < CHUNK_COLS; i++, run--) {
+	if (run == 0) {
+	    // buildings with gaps at ground level between them, a gap first
+	    gap = !gap || tallest < 3;
+	    tall = (gap) ? 2: 3 + rngRange(tallest - 2);
+	    run = (gap) ? 1 + rngRange(3): 3 + rngRange(6);
+	}
+	heights[i] = tall;
+    }
+    rng = saved;
+    return 1;
+}
+
+/**
+ * Make the layout of an endless city a ring of chunks, CHUNK_SPARE more
+ * than the view spans so the view can scroll on without showing a chunk
+ * still being loaded, and fill it with the first chunks of the city. The
+ * config's city is kept as the start of the stream.
+ *
+ * @param game game whose city goes on
+ * @return 0 if out of memory or the level file could not be read
+ *         1 if successful
+ */
+int fillStream(struct Game *game) {
+    struct Stream *stream = game->stream;
+    int nslots = (WIDTH + CHUNK_COLS - 1) / CHUNK_COLS + CHUNK_SPARE;
+    uint8_t *layout = malloc(sizeof *layout * nslots * CHUNK_COLS +
+		    LAYOUT_PAD);
+    uint8_t *heights = malloc(sizeof *heights * nslots * CHUNK_COLS);
+    stream->slots = calloc(nslots, sizeof *stream->slots);
+    if (layout == NULL || heights == NULL || stream->slots == NULL) {
+	free(layout);
+	free(heights);
+	free(stream->slots);
+	stream->slots = NULL;
+	return 0;
+    }
+    stream->nslots = nslots;
+    stream->city = game->layout;
+    stream->citySize = game->size;
+    game->layout = layout;
+    game->size = game->cap = nslots * CHUNK_COLS;
+    for (int i = 0; i < nslots; i++) {
+	stream->slots[i] = (struct Chunk) { .seq = i, .shown = i,
+		.staged = -1, .heights = heights + i * CHUNK_COLS };
+	if (!fillChunk(stream, i, layout + i * CHUNK_COLS)) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Allocate the collision grid for the world, which is as wide as the city
+ * or the terminal, whichever is wider, or is the ring of chunks of an
+ * endless city. The grid holds the background of
+ * every world cell (city, debris, explosions) and the sky counts the
+ * missiles in each cell. Messages are kept apart, in terminal coordinates.
+ * The shield cover is one count per world col, and the shield row and
+ * the explosions of each row are also kept as bitsets of the world cols
+ * for collision tests. A match that is not drawn
+ * gets no message text or dirty rows.
+ * A fixed build uses static arrays BOARD_WORLD columns wide instead, so
+ * the city must fit in BOARD_WORLD.
+ *
+ * @param game game to add grid to
+ * @param drawn whether the match is shown on a terminal or to clients
+ * @return 0 if grid could not be allocated
+ *         1 if successful
+ */
+int createGrid(struct Game *game, _Bool drawn) {
+#ifdef BOARD_WIDTH
+    static char grid[BOARD_HEIGHT * BOARD_WORLD];
+    static uint32_t sky[BOARD_HEIGHT * BOARD_WORLD];
+    static char text[BOARD_HEIGHT * BOARD_WIDTH];
+    static int dirtyTop[BOARD_WORLD], dirtyBottom[BOARD_WORLD];
+    static unsigned char cover[BOARD_WORLD];
+    static atomic_ullong shielded[ROW_WORDS];
+    static atomic_ullong blasts[BOARD_HEIGHT * ROW_WORDS];
+    static struct Message messages[MSG_SLOTS];
+    static uint8_t skyline[4 * BOARD_WORLD]; // leaves < 2 * BOARD_WORLD
+    game->skyline = skyline;
+    game->worldWidth = BOARD_WORLD;
+    size_t cells = sizeof grid;
+    game->grid = grid;
+    game->sky = sky;
+    game->cover = cover;
+    game->shielded = shielded;
+    game->blasts = blasts;
+    if (drawn) {
+	game->text = text;
+	game->messages = messages;
+	game->dirtyTop = dirtyTop;
+	game->dirtyBottom = dirtyBottom;
+    }
+#else
+    if (game->stream && !fillStream(game)) return 0;
+    game->worldWidth = (game->size > WIDTH) ? game->size: WIDTH;
+    size_t cells = (size_t) HEIGHT * WORLD_WIDTH;
+    game->grid = malloc(cells);
+    game->sky = calloc(cells, sizeof *game->sky);
+    game->cover = calloc(WORLD_WIDTH, sizeof *game->cover);
+    game->shielded = calloc(ROW_WORDS, sizeof *game->shielded);
+    game->blasts = calloc((size_t) HEIGHT * ROW_WORDS,
+		    sizeof *game->blasts);
+    game->skyline = malloc(sizeof *game->skyline * 2 *
+		    skylineLeaves(game->size));
+    if (drawn) {
+	game->text = malloc((size_t) HEIGHT * WIDTH);
+	game->messages = malloc(sizeof *game->messages * MSG_SLOTS);
+	game->dirtyTop = malloc(sizeof *game->dirtyTop * WORLD_WIDTH);
+	game->dirtyBottom = malloc(sizeof *game->dirtyBottom * WORLD_WIDTH);
+    }
+#endif
+    if (game->grid == NULL || game->sky == NULL || game->cover == NULL ||
+		    game->shielded == NULL || game->blasts == NULL ||
+		    game->skyline == NULL ||
+		    (drawn && (game->text == NULL || game->messages == NULL ||
+			       game->dirtyTop == NULL ||
+			       game->dirtyBottom == NULL))) {
+	return 0;
+    }
+    memset(game->grid, ' ', cells);
+    buildSkyline(game);
+    if (!drawn) return 1;
+    memset(game->text, ' ', (size_t) HEIGHT * WIDTH);
+    for (int i = 0; i < MSG_SLOTS; i++) game->messages[i].seq = i;
+    for (int x = 0; x < WORLD_WIDTH; x++) {
+	game->dirtyTop[x] = HEIGHT;
+	game->dirtyBottom[x] = -1;
+    }
+    return 1;
+}
+
+/**
+ * Get background character of a cell from the collision grid. Caller must
+ * hold the stripe lock of x.
+ *
+ * @param y row of cell
+ * @param x world col of cell
+ * @return background character
+ */
+char cellAt(int y, int x) {
+    return game->grid[(size_t) y * WORLD_WIDTH + x];
+}
+
+/**
+ * Test the bit of a world col in a row bitset, one word of 64 cols at a
+ * time
+ *
+ * @param row ROW_WORDS words of bitset
+ * @param x world col
+ * @return 1 if the bit is set
+ */
+_Bool testCol(atomic_ullong *row, int x) {
+    return atomic_load_explicit(row + (x >> 6), memory_order_relaxed) >>
+	    (x & 63) & 1;
+}
+
+/**
+ * Set or clear the bit of a world col in a row bitset. The other cols of
+ * its word may belong to other stripes, so the word is updated
+ * atomically.
+ *
+ * @param row ROW_WORDS words of bitset
+ * @param x world col
+ * @param on 1 to set the bit, 0 to clear it
+ */
+void markCol(atomic_ullong *row, int x, _Bool on) {
+    unsigned long long bit = 1ull << (x & 63);
+    if (on) atomic_fetch_or_explicit(row + (x >> 6), bit, memory_order_relaxed);
+    else atomic_fetch_and_explicit(row + (x >> 6), ~bit, memory_order_relaxed);
+}
+
+/**
+ * Get the terminal col a world col is shown at. The view may wrap around
+ * the ring of an endless city.
+ *
+ * @param x world col
+ * @return terminal col, WIDTH or more if x is not in view
+ */
+int screenCol(int x) {
+    int sx = x - game->viewX;
+    return (sx < 0) ? sx + WORLD_WIDTH: sx;
+}
+
+/**
+ * Get the world col shown at a terminal col
+ *
+ * @param viewX world col at left edge of terminal
+ * @param sx terminal col
+ * @return world col
+ */
+int worldCol(int viewX, int sx) {
+    int x = viewX + sx;
+    return (x >= WORLD_WIDTH) ? x - WORLD_WIDTH: x;
+}
+
+/**
+ * Get the character shown for a world cell in view: the shield, else a
+ * missile, else message text, else the background. Caller must hold the
+ * stripe lock of x; the message text belongs to the render thread.
+ *
+ * @param y row of cell
+ * @param x world col of cell
+ * @return character to draw
+ */
+char glyphAt(int y, int x) {
+    if (y == game->defender->shieldY && testCol(game->shielded, x)) {
+	return '#';
+    }
+    if (game->sky[(size_t) y * WORLD_WIDTH + x]) return '|';
+    char t = game->text[(size_t) y * WIDTH + screenCol(x)];
+    return (t != ' ') ? t: cellAt(y, x);
+}
+
+/**
+ * Mark a world cell for redrawing with the next frame after its state
+ * changed, if it is in view. Caller must hold the stripe lock of x.
+ *
+ * @param y row of cell
+ * @param x world col of cell
+ */
+void showCell(int y, int x) {
+    if ((headless && !serving) || screenCol(x) >= WIDTH) return;
+    if (y < game->dirtyTop[x]) game->dirtyTop[x] = y;
+    if (y > game->dirtyBottom[x]) game->dirtyBottom[x] = y;
+}
+
+/**
+ * Lock the stripe of the world col currently shown at terminal col sx.
+ * Holding any stripe keeps the view from scrolling.
+ *
+ * @param sx terminal col
+ * @return world col shown at sx
+ */
+int lockScreenCol(int sx) {
+    for (;;) {
+	int viewX = game->viewX;
+	int x = worldCol(viewX, sx);
+	lock(stripeOf(x));
+	if (viewX == game->viewX) return x;
+	unlock(stripeOf(x));
+    }
+}
+
+/**
+ * Post a message for the render thread to lay out with the next frame.
+ * Never blocks: claims a slot of the message ring with a compare and
+ * swap, and drops the message if the ring is full. Any thread may post.
+ * Messages stay in place on the terminal as the view scrolls.
+ *
+ * @param row status row to replace, or MSG_LOG to add a line to the log
+ * @param str message, cut to MSG_LEN - 1 characters
+ * @return 0 if the ring was full
+ *         1 if successful, or if nothing is drawn
+ */
+int postMessage(int row, const char *str) {
+    if (game->messages == NULL) return 1; // nothing is drawn
+    unsigned pos = atomic_load_explicit(&game->msgTail, memory_order_relaxed);
+    struct Message *m;
+    for (;;) {
+	m = game->messages + pos % MSG_SLOTS;
+	int lag = (int) (atomic_load_explicit(&m->seq, memory_order_acquire) -
+			pos);
+	if (lag < 0) return 0; // slot not laid out since last lap
+	if (lag == 0 && atomic_compare_exchange_weak_explicit(&game->msgTail,
+				&pos, pos + 1, memory_order_relaxed,
+				memory_order_relaxed)) {
+	    break;
+	}
+	if (lag > 0) {
+	    pos = atomic_load_explicit(&game->msgTail, memory_order_relaxed);
+	}
+    }
+    m->row = row;
+    snprintf(m->text, MSG_LEN, "%s", str);
+    atomic_store_explicit(&m->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+/**
+ * Post "<who>: <what>" on status row ERROR_ROW and end the game
+ *
+ * @param who function that failed
+ * @param what reason
+ */
+void postError(const char *who, const char *what) {
+    char line[MSG_LEN];
+    snprintf(line, sizeof line, "%s: %s", who, what);
+    postMessage(ERROR_ROW, line);
+    endGame();
+}
+
+/**
+ * Post "The <name><ended>" to the message log
+ *
+ * @param name name of defender or attacker
+ * @param ended rest of message
+ */
+void postEnd(const char *name, const char *ended) {
+    char line[MSG_LEN];
+    snprintf(line, sizeof line, "The %s%s", name, ended);
+    postMessage(MSG_LOG, line);
+}
+
+/**
+ * Replace a row of message text, padded with blanks, and mark the cells
+ * that changed for redrawing
+ *
+ * @param y row of terminal
+ * @param str new text of row
+ * @param n characters of str to use, at most WIDTH
+ */
+void writeRow(int y, const char *str, int n) {
+    for (int sx = 0; sx < WIDTH; sx++) {
+	char c = (sx < n) ? str[sx]: ' ';
+	char *t = game->text + (size_t) y * WIDTH + sx;
+	if (*t == c) continue;
+	int x = lockScreenCol(sx);
+	*t = c;
+	showCell(y, x);
+	unlock(stripeOf(x));
+    }
+}
+
+/**
+ * Add a message to the log, the rows from LOG_TOP down to the row above
+ * the shields. A message wraps onto as many rows as it needs; once the
+ * log is full it scrolls up.
+ *
+ * @param str message
+ */
+void logMessage(const char *str) {
+    int bottom = game->defender->shieldY - 1;
+    int rows = bottom - LOG_TOP + 1;
+    int len = strlen(str);
+    int need = (len + WIDTH - 1) / WIDTH;
+    if (need == 0) need = 1;
+    if (need > rows) need = rows;
+    int over = game->logRow + need - 1 - bottom;
+    if (over > 0) {
+	for (int y = LOG_TOP; y + over <= bottom; y++) {
+	    writeRow(y, game->text + (size_t) (y + over) * WIDTH, WIDTH);
+	}
+	game->logRow -= over;
+    }
+    for (int i = 0; i < need; i++) {
+	int n = len - i * WIDTH;
+	writeRow(game->logRow++, str + i * WIDTH, (n > WIDTH) ? WIDTH:
+			(n < 0) ? 0: n);
+    }
+}
+
+/**
+ * Lay out every message posted since the last frame. Called by the
+ * render thread only, or once it has stopped; that thread alone writes
+ * the message text.
+ */
+void layoutMessages(void) {
+    if (game->messages == NULL) return;
+    for (;;) {
+	struct Message *m = game->messages + game->msgHead % MSG_SLOTS;
+	if (atomic_load_explicit(&m->seq, memory_order_acquire) !=
+			game->msgHead + 1) {
+	    return;
+	}
+	if (m->row == MSG_LOG) logMessage(m->text);
+	else if (m->row >= 0 && m->row < LOG_TOP && m->row < HEIGHT) {
+	    int n = strlen(m->text);
+	    writeRow(m->row, m->text, (n > WIDTH) ? WIDTH: n);
+	}
+	atomic_store_explicit(&m->seq, game->msgHead + MSG_SLOTS,
+			memory_order_release);
+	game->msgHead++;
+    }
+}
+
+/**
+ * Allocate the frame buffers. Every frame starts blank, like the curses
+ * window.
+ *
+ * @return 0 if out of memory
+ *         1 if successful
+ */
+int createFrames(void) {
+    size_t cells = (size_t) HEIGHT * WIDTH;
+    char **bufs[5] = { frames.cells, frames.cells + 1, frames.cells + 2,
+	    &frames.image, &frames.shown };
+    for (int i = 0; i < 5; i++) {
+	*bufs[i] = malloc(cells);
+	if (*bufs[i] == NULL) return 0;
+	memset(*bufs[i], ' ', cells);
+    }
+    frames.back = 0;
+    frames.middle = 1;
+    frames.front = 2;
+    pthread_mutex_init(&frames.lock, NULL);
+    pthread_cond_init(&frames.ready, NULL);
+    return 1;
+}
+
+/**
+ * Free the frame buffers
+ */
+void destroyFrames(void) {
+    for (int i = 0; i < 3; i++) free(frames.cells[i]);
+    free(frames.image);
+    free(frames.shown);
+    if (frames.notify[0] != -1) close(frames.notify[0]);
+    if (frames.notify[1] != -1) close(frames.notify[1]);
+}
+
+/**
+ * Lay out the messages posted, then bring the image of the view up to
+ * date from the dirty cells, taking the stripe locks one block of
+ * STRIPE_COLS columns at a time, and publish it as the newest frame if it
+ * changed. Called by the render thread only, or once it has stopped.
+ */
+void composeFrame(void) {
+    layoutMessages();
+    _Bool changed = 0;
+    int nblocks = (WORLD_WIDTH + STRIPE_COLS - 1) / STRIPE_COLS;
+    int first = game->viewX / STRIPE_COLS;
+    int blocks = (game->viewX % STRIPE_COLS + WIDTH - 1) / STRIPE_COLS + 1;
+    for (int i = 0; i < blocks; i++) {
+	int b = (first + i) % nblocks; // the view may wrap around the ring
+	struct Lock *stripe = stripeOf(b * STRIPE_COLS);
+	lock(stripe);
+	int end = (b + 1) * STRIPE_COLS;
+	if (end > WORLD_WIDTH) end = WORLD_WIDTH;
+	for (int x = b * STRIPE_COLS; x < end; x++) {
+	    // the view cannot scroll while stripe is held
+	    int sx = screenCol(x);
+	    if (sx >= WIDTH) continue;
+	    for (int y = game->dirtyTop[x]; y <= game->dirtyBottom[x]; y++) {
+		frames.image[y * WIDTH + sx] = glyphAt(y, x);
+		changed = 1;
+	    }
+	    game->dirtyTop[x] = HEIGHT;
+	    game->dirtyBottom[x] = -1;
+	}
+	unlock(stripe);
+    }
+    if (!changed) return;
+    memcpy(frames.cells[frames.back], frames.image, (size_t) HEIGHT * WIDTH);
+    frames.back = atomic_exchange(&frames.middle,
+		    frames.back | FRAME_FRESH) & ~FRAME_FRESH;
+    pthread_mutex_lock(&frames.lock);
+    pthread_cond_signal(&frames.ready);
+    pthread_mutex_unlock(&frames.lock);
+    if (frames.notify[1] != -1) {
+	while (write(frames.notify[1], "", 1) == -1 && errno == EINTR);
+    }
+}
+
+/**
+ * Take the newest frame if it has not been taken yet. Called by the
+ * thread that shows frames only.
+ *
+ * @return glyphs of frame, height rows of width
+ *         NULL if no fresh frame
+ */
+const char *takeFrame(void) {
+    if (!(atomic_load(&frames.middle) & FRAME_FRESH)) return NULL;
+    frames.front = atomic_exchange(&frames.middle, frames.front) &
+	    ~FRAME_FRESH;
+    return frames.cells[frames.front];
+}
+
+/**
+ * Write the newest frame to the terminal if it has not been shown,
+ * rewriting only the cells that differ from the last frame shown. Called
+ * by the output thread only; takes no simulation lock.
+ */
+void showFrame(void) {
+    const char *cells = takeFrame();
+    if (cells == NULL) return;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int y = 0; y < HEIGHT; y++) {
+	for (int x = 0; x < WIDTH; x++) {
+	    size_t i = (size_t) y * WIDTH + x;
+	    if (cells[i] == frames.shown[i]) continue;
+	    mvaddch(y, x, cells[i]);
+	    frames.shown[i] = cells[i];
+	}
+    }
+    wnoutrefresh(stdscr);
+    doupdate();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ns = elapsedNs(&start, &end);
+    long avg = atomic_load_explicit(&frames.flushNs, memory_order_relaxed);
+    atomic_store_explicit(&frames.flushNs, avg + (ns - avg) / 8,
+		    memory_order_relaxed);
+    tally(&mine->refreshes, 1);
+    tally(&mine->refreshNs, ns);
+}
+
+/**
+ * Get the interval to the next frame. A terminal whose flushes take
+ * longer than a frame, such as over a slow link, is sent frames only as
+ * fast as it takes them, down to MIN_FPS.
+ *
+ * @param frameNs interval at game->fps
+ * @return nanoseconds to the next frame
+ */
+long framePace(long frameNs) {
+    long ns = atomic_load_explicit(&frames.flushNs, memory_order_relaxed) *
+	    PACE_HEADROOM_NUM / PACE_HEADROOM_DEN;
+    if (ns > 1000000000L / MIN_FPS) ns = 1000000000L / MIN_FPS;
+    return (ns > frameNs) ? ns: frameNs;
+}
+
+/**
+ * Set background character of a cell in the collision grid and draw it.
+ * Caller must hold the stripe lock of x.
+ *
+ * @param y row of cell
+ * @param x world col of cell
+ * @param c new background character
+ */
+void putCell(int y, int x, char c) {
+    char *cell = game->grid + (size_t) y * WORLD_WIDTH + x;
+    if ((*cell == '*') != (c == '*')) {
+	markCol(game->blasts + (size_t) y * ROW_WORDS, x, c == '*');
+    }
+    *cell = c;
+    showCell(y, x);
+}
+
+/**
+ * Mark every cell in view for redrawing. Caller must hold all stripe
+ * locks.
+ */
+void redrawScreen(void) {
+    if (headless && !serving) return;
+    for (int sx = 0; sx < WIDTH; sx++) {
+	int x = worldCol(game->viewX, sx);
+	game->dirtyTop[x] = 0;
+	game->dirtyBottom[x] = HEIGHT - 1;
+    }
+}
+
+/**
+ * Get the col of an endless city shown in a world col: the one of the
+ * chunks in the ring that is congruent to it. Caller must hold
+ * shieldLock.
+ *
+ * @param x world col
+ * @return col of city
+ */
+long cityCol(int x) {
+    long start = game->stream->first * CHUNK_COLS;
+    int rel = x - start % WORLD_WIDTH;
+    return start + ((rel < 0) ? rel + WORLD_WIDTH: rel);
+}
+
+/**
+ * Hand the slot of chunk n of an endless city to the loader. Caller must
+ * hold the stream lock.
+ *
+ * @param stream stream of city
+ * @param n chunk wanted
+ */
+void wantChunk(struct Stream *stream, long n) {
+    struct Chunk *chunk = stream->slots + n % stream->nslots;
+    chunk->seq = n;
+    chunk->deadline = 0;
+    int pending = 0;
+    for (int i = 0; i < stream->nslots; i++) {
+	pending += stream->slots[i].seq != stream->slots[i].shown;
+    }
+    atomic_store_explicit(&stream->pending, pending, memory_order_relaxed);
+}
+
+/**
+ * Move the ring of an endless city along with the view, so the view stays
+ * two chunks clear of both ends of it. The chunk left behind is refilled
+ * with the next one ahead by the loader thread. Caller must hold
+ * shieldLock.
+ *
+ * @param view col of city at left edge of terminal
+ */
+void scrollStream(long view) {
+    struct Stream *stream = game->stream;
+    long left = view / CHUNK_COLS, right = (view + WIDTH - 1) / CHUNK_COLS;
+    int n = stream->nslots;
+    pthread_mutex_lock(&stream->lock);
+    long first = stream->first;
+    while (right >= stream->first + n - 2) {
+	wantChunk(stream, stream->first + n);
+	stream->first++;
+    }
+    while (left <= stream->first + 1 && stream->first > 0) {
+	stream->first--;
+	wantChunk(stream, stream->first);
+    }
+    if (stream->first != first) pthread_cond_signal(&stream->wake);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+/**
+ * Scroll the view so the shield stays at least a quarter of the terminal
+ * away from both edges. An endless city has no right edge, and its view
+ * moves even when nothing is drawn, since the chunks loaded follow it.
+ * Caller must hold shieldLock.
+ *
+ * @param shieldX new world col of shield
+ */
+void followShield(int shieldX) {
+    struct Stream *stream = game->stream;
+    if (headless && !serving && stream == NULL) return; // no view to scroll
+    int margin = WIDTH / 4;
+    long shield = (stream) ? cityCol(shieldX): shieldX;
+    long view = (stream) ? cityCol(game->viewX): game->viewX;
+    if (shield < view + margin) view = shield - margin;
+    else if (shield + SHIELD_WIDTH > view + WIDTH - margin) {
+	view = shield + SHIELD_WIDTH - WIDTH + margin;
+    }
+    if (stream == NULL && view > WORLD_WIDTH - WIDTH) {
+	view = WORLD_WIDTH - WIDTH;
+    }
+    if (view < 0) view = 0;
+    int viewX = view % WORLD_WIDTH;
+    if (viewX == game->viewX) return;
+    if (stream) scrollStream(view);
+    if (headless && !serving) {
+	game->viewX = viewX;
+	return;
+    }
+    for (int i = 0; i < NSTRIPES; i++) lock(game->stripes + i);
+    game->viewX = viewX;
+    redrawScreen();
+    for (int i = NSTRIPES - 1; i >= 0; i--) unlock(game->stripes + i);
+}
+
+/**
+ * Initialize display for city and defender (shield). Must be called
+ * before any other thread starts.
+ *
+ * @param game container includes information about city layout
+ */
+void initDisplay(struct Game *game) {
+    int prev = 2;
+    for (int i = 0; i < WORLD_WIDTH; i++) {
+	int curr = (i > game->size - 1) ? 2: game->layout[i];
+	if (curr > 2 && curr > prev) {
+	    for (int j = HEIGHT - curr + 1; j <= HEIGHT - 2; j++) {
+		game->grid[(size_t) j * WORLD_WIDTH + i] = '|';
+	    }
+	} else if (curr >= 1) {
+	    if (prev > curr && prev > 2 && cellAt(HEIGHT - prev, i - 1) == '_') {
+		game->grid[(size_t) (HEIGHT - prev) * WORLD_WIDTH + i - 1] =
+			' ';
+		for (int j = HEIGHT - prev + 1; j <= HEIGHT - 2; j++) {
+		    game->grid[(size_t) j * WORLD_WIDTH + i - 1] = '|';
+		}
+	    }
+	    game->grid[(size_t) (HEIGHT - curr) * WORLD_WIDTH + i] = '_';
+	}
+	prev = curr;
+    }
+    game->defender->shieldY = HEIGHT -
+	    ((game->tallest < 2) ? 2: game->tallest) - 2;
+    struct Defender *defender = game->defender;
+    // spread evenly across the world, one in the middle, or across the
+    // start of an endless city
+    int span = (game->stream) ? WIDTH: WORLD_WIDTH;
+    for (int i = 0; i < defender->nshields; i++) {
+	int x = span * (i + 1) / (defender->nshields + 1) - SHIELD_WIDTH / 2;
+	if (x > WORLD_WIDTH - SHIELD_WIDTH) x = WORLD_WIDTH - SHIELD_WIDTH;
+	defender->shields[i].x = (x < 0) ? 0: x;
+	for (int c = 0; c < SHIELD_WIDTH; c++) {
+	    int col = defender->shields[i].x + c;
+	    if (game->cover[col]++ == 0) markCol(game->shielded, col, 1);
+	}
+    }
+    int viewX = defender->shields[0].x + SHIELD_WIDTH / 2 - WIDTH / 2;
+    if (viewX > WORLD_WIDTH - WIDTH) viewX = WORLD_WIDTH - WIDTH;
+    game->viewX = (viewX < 0) ? 0: viewX;
+    redrawScreen();
+}
+
+/**
+ * Move a shield one column. Missiles read the shield bitset without
+ * locking, so a move only waits on missiles in the column it uncovers.
+ * The view follows shield 0.
+ *
+ * @param ndefender defender whose shield moves
+ * @param s index of shield
+ * @param dir -1 to move left, 1 to move right
+ */
+void moveShield(struct Defender *ndefender, int s, int dir) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lock(&game->shieldLock);
+    int x = ndefender->shields[s].x;
+    int vacated;
+    // shields go around the ring of an endless city, up to its start
+    if (dir < 0 && ((game->stream) ? cityCol(x) > 0: x > 0)) {
+	vacated = (x + SHIELD_WIDTH - 1) % WORLD_WIDTH;
+	x = (x > 0) ? x - 1: WORLD_WIDTH - 1;
+    } else if (dir > 0 && (game->stream ||
+			    x < WORLD_WIDTH - SHIELD_WIDTH)) {
+	vacated = x;
+	x = (x + 1) % WORLD_WIDTH;
+    } else {
+	unlock(&game->shieldLock);
+	return;
+    }
+    ndefender->shields[s].x = x;
+    int entered = (dir < 0) ? x: (x + SHIELD_WIDTH - 1) % WORLD_WIDTH;
+    if (--game->cover[vacated] == 0) markCol(game->shielded, vacated, 0);
+    if (game->cover[entered]++ == 0) markCol(game->shielded, entered, 1);
+    lock(stripeOf(vacated));
+    putCell(ndefender->shieldY, vacated, ' ');
+    unlock(stripeOf(vacated));
+    lock(stripeOf(entered));
+    showCell(ndefender->shieldY, entered);
+    unlock(stripeOf(entered));
+    if (s == 0) followShield(x);
+    unlock(&game->shieldLock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    histAdd(&bench.shield, elapsedNs(&start, &end));
+}
+
+/**
+ * Queue a move of a shield to be applied by the render thread, or by the
+ * tick engine in lockstep. Drops the move if the queue is full. Only one
+ * thread may queue moves for a shield.
+ *
+ * @param defender defender whose shield moves
+ * @param s index of shield
+ * @param dir -1 to move left, 1 to move right
+ */
+void queueKey(struct Defender *defender, int s, int dir) {
+    struct KeyQueue *keys = &defender->shields[s].keys;
+    unsigned tail = atomic_load_explicit(&keys->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&keys->head, memory_order_acquire) ==
+		    KEY_QUEUE_LEN) {
+	return;
+    }
+    keys->dir[tail % KEY_QUEUE_LEN] = dir;
+    atomic_store_explicit(&keys->tail, tail + 1, memory_order_release);
+    pthread_mutex_lock(&defender->keysLock);
+    pthread_cond_signal(&defender->keysReady);
+    pthread_mutex_unlock(&defender->keysLock);
+}
+
+/**
+ * Take the queued moves of a shield. Only one thread may take moves.
+ *
+ * @param keys queue of moves
+ * @param dir set to moves taken, room for KEY_QUEUE_LEN
+ * @return number of moves taken
+ */
+int takeKeys(struct KeyQueue *keys, int *dir) {
+    unsigned head = atomic_load_explicit(&keys->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&keys->tail, memory_order_acquire);
+    int n = 0;
+    for (; head != tail; head++) dir[n++] = keys->dir[head % KEY_QUEUE_LEN];
+    atomic_store_explicit(&keys->head, head, memory_order_release);
+    return n;
+}
+
+/**
+ * Check for queued moves of any shield
+ *
+ * @param defender defender to check
+ * @return 1 if a move is queued
+ */
+_Bool keysQueued(struct Defender *defender) {
+    for (int s = 0; s < defender->nshields; s++) {
+	struct KeyQueue *keys = &defender->shields[s].keys;
+	if (atomic_load_explicit(&keys->head, memory_order_relaxed) !=
+		    atomic_load_explicit(&keys->tail, memory_order_acquire)) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Function for input thread, reads the defender's keys. Shield s moves
+ * with the keys in row s of keymap. Sleeps in poll on the terminal and the
+ * wake pipe, so it returns as soon as the game ends.
+ *
+ * @param defender defender to control
+ * @return NULL
+ */
+void *startDef(void *defender) {
+    static const int keymap[MAX_SHIELDS][2] = {
+	{ KEY_LEFT, KEY_RIGHT }, { 'a', 'd' }, { 'j', 'l' }, { '4', '6' }
+    };
+    struct Defender *ndefender = defender;
+    game = ndefender->game;
+    countThread("input");
+    struct pollfd fds[2] = {
+	{ .fd = STDIN_FILENO, .events = POLLIN },
+	{ .fd = ndefender->wake[0], .events = POLLIN }
+    };
+    nodelay(ndefender->input, 1);
+    flushinp();
+    while (!*ndefender->gameOver) {
+	if (poll(fds, 2, -1) == -1) {
+	    if (errno == EINTR) continue;
+	    break;
+	}
+	if (fds[1].revents) break;
+	int c;
+	while ((c = wgetch(ndefender->input)) != ERR) {
+	    if (c == 'q') {
+		stopGame();
+	    } else if (c == 's') {
+		game->overlay = !game->overlay;
+	    }
+	    for (int s = 0; s < ndefender->nshields; s++) {
+		if (c == keymap[s][0]) queueKey(ndefender, s, -1);
+		else if (c == keymap[s][1]) queueKey(ndefender, s, 1);
+	    }
+	}
+	if (fds[0].revents & (POLLHUP | POLLERR)) stopGame();
+    }
+    postEnd(ndefender->name, " defense has ended.");
+    return NULL;
+}
+
+/**
+ * Block SIGINT, SIGTERM and SIGHUP in this thread and every thread it
+ * goes on to start, and open signals to read them from. A signal then
+ * stops the game like a quit, instead of killing the process with the
+ * terminal left as curses set it up. Call before starting any thread.
+ *
+ * @return 0 if the signals could not be blocked
+ *         1 if successful
+ */
+int watchSignals(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) return 0;
+    signals = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    return signals != -1;
+}
+
+/**
+ * Function for signal thread. Sleeps in poll on signals and signalWake,
+ * and stops the game on every signal that arrives until it is woken. The
+ * program then closes without waiting for the enter key.
+ *
+ * @param g game to stop
+ * @return NULL
+ */
+void *startSignals(void *g) {
+    game = g;
+    countThread("signals");
+    struct pollfd fds[2] = {
+	{ .fd = signals, .events = POLLIN },
+	{ .fd = signalWake[0], .events = POLLIN }
+    };
+    for (;;) {
+	if (poll(fds, 2, -1) == -1) {
+	    if (errno == EINTR) continue;
+	    break;
+	}
+	struct signalfd_siginfo info;
+	while (read(signals, &info, sizeof info) == sizeof info) {
+	    caught = info.ssi_signo;
+	    char line[MSG_LEN];
+	    snprintf(line, sizeof line, "Stopped: %s.",
+			    strsignal(info.ssi_signo));
+	    postMessage(MSG_LOG, line);
+	    stopGame();
+	}
+	if (fds[1].revents) break;
+    }
+    return NULL;
+}
+
+/**
+ * Restore the terminal at exit if curses still has it, whichever thread
+ * exits
+ */
+void restoreTerminal(void) {
+    if (!isendwin()) endwin();
+}
+
+/**
+ * Wait for the enter key, or for a signal to close the program instead.
+ * Curses must be running.
+ */
+void waitForEnter(void) {
+    struct pollfd fds[2] = {
+	{ .fd = STDIN_FILENO, .events = POLLIN },
+	{ .fd = signals, .events = POLLIN }
+    };
+    nodelay(stdscr, 1);
+    flushinp();
+    for (;;) {
+	if (poll(fds, 2, -1) == -1) {
+	    if (errno == EINTR) continue;
+	    return;
+	}
+	if (fds[1].revents) return;
+	int c;
+	while ((c = getch()) != ERR) {
+	    if (c == '\n') return;
+	}
+	if (fds[0].revents & (POLLHUP | POLLERR)) return;
+    }
+}
+
+/**
+ * Function for headless defense thread, moves every shield at random until
+ * the attack ends or the run has lasted duration seconds. Moves none when
+ * serving.
+ *
+ * @param defender defender to control
+ * @return NULL
+ */
+void *startBot(void *defender) {
+    struct Defender *ndefender = defender;
+    game = ndefender->game;
+    struct timespec start, now, next;
+    countThread("bot");
+    seedThread(2);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!*ndefender->gameOver) {
+	// network clients move the shields when serving
+	for (int s = 0; s < ndefender->nshields && !serving; s++) {
+	    int dir = rngRange(3) - 1;
+	    if (dir != 0) queueKey(ndefender, s, dir);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (ndefender->duration > 0 && elapsedNs(&start, &now) >=
+			ndefender->duration * 1000000000ULL) {
+	    endGame();
+	}
+	deadline(&next, 20);
+	nap(&next, ndefender->gameOver);
+    }
+    postEnd(ndefender->name, " defense has ended.");
+    return NULL;
+}
+
+/**
+ * Clear debris from the background of a cell a missile flies into; the
+ * missile wipes out city outlines, debris and old explosions it passes.
+ *
+ * @param y row of cell
+ * @param x world col of cell
+ * @return previous background character
+ */
+char enterCell(int y, int x) {
+    char c = cellAt(y, x);
+    if (c == '|' || c == '_' || c == '?' || c == '*') {
+	game->grid[(size_t) y * WORLD_WIDTH + x] = ' ';
+    }
+    if (c == '*') markCol(game->blasts + (size_t) y * ROW_WORDS, x, 0);
+    return c;
+}
+
+/**
+ * Draw a newly launched missile at its starting position. Caller must
+ * hold the stripe lock of its column.
+ *
+ * @param nmissile missile to place
+ */
+void placeMissile(struct Missile *nmissile) {
+    enterCell(nmissile->y, nmissile->x);
+    game->sky[(size_t) nmissile->y * WORLD_WIDTH + nmissile->x]++;
+    showCell(nmissile->y, nmissile->x);
+}
+
+/**
+ * Update the roof from the skyline tree. Once the last building above
+ * ground level falls, the city is destroyed and the game ends. Caller
+ * must hold skylineLock.
+ */
+void updateRoof(void) {
+    int top = game->skyline[1];
+    int old = atomic_exchange_explicit(&game->roof, top,
+		    memory_order_relaxed);
+    if (old > 2 && top <= 2) {
+	postMessage(MSG_LOG, "The city has been destroyed.");
+	endGame();
+    }
+}
+
+/**
+ * Bring the skyline tree up to date with the height of a city column,
+ * stopping at the first ancestor whose max is unchanged. Caller must hold
+ * the stripe lock of x and skylineLock.
+ *
+ * @param x col of city that changed
+ */
+void updateSkyline(int x) {
+    int i = game->skylineLeaves + x;
+    game->skyline[i] = game->layout[x];
+    for (i /= 2; i >= 1; i /= 2) {
+	int l = game->skyline[2 * i], r = game->skyline[2 * i + 1];
+	int top = (l > r) ? l: r;
+	if (game->skyline[i] == top) break;
+	game->skyline[i] = top;
+    }
+}
+
+/**
+ * Lower the skyline tree to the height a city column was hit down to.
+ * The tick engine updates the roof once per tick instead, so the moves of
+ * a tick never see each other's damage. Caller must hold the stripe lock
+ * of x.
+ *
+ * @param x col of city that was hit
+ */
+void lowerColumn(int x) {
+    pthread_mutex_lock(&game->skylineLock);
+    updateSkyline(x);
+    if (!game->attacker->tickEngine) updateRoof();
+    pthread_mutex_unlock(&game->skylineLock);
+}
+
+/**
+ * Redraw the city in a world col of an endless city from its height and
+ * those of its neighbours, as initDisplay draws it, clearing the debris
+ * below the shield row. Caller must hold the stripe locks of x and its
+ * neighbours.
+ *
+ * @param x world col
+ */
+void drawColumn(int x) {
+    int prev = game->layout[(x > 0) ? x - 1: WORLD_WIDTH - 1];
+    int curr = game->layout[x];
+    int next = game->layout[(x + 1) % WORLD_WIDTH];
+    for (int y = game->defender->shieldY + 1; y < HEIGHT; y++) {
+	putCell(y, x, ' ');
+    }
+    // a wall where the city steps up onto or down off a building
+    if ((curr > 2 && curr > prev) || (curr > 2 && curr > next && next >= 1)) {
+	for (int y = HEIGHT - curr + 1; y <= HEIGHT - 2; y++) {
+	    putCell(y, x, '|');
+	}
+    } else if (curr >= 1) {
+	putCell(HEIGHT - curr, x, '_');
+    }
+}
+
+/**
+ * Show the chunk staged in a slot of the ring of an endless city: copy its
+ * heights into the layout, redraw its columns and the ones next to them,
+ * and update the skyline tree. Takes the stripe locks of those columns in
+ * order, like followShield. Caller must hold the stream lock.
+ *
+ * @param stream stream of city
+ * @param slot slot whose chunk is staged
+ */
+void showChunk(struct Stream *stream, int slot) {
+    struct Chunk *chunk = stream->slots + slot;
+    int start = slot * CHUNK_COLS;
+    uint64_t held = 0; // one bit per stripe, NSTRIPES of them
+    for (int i = -1; i <= CHUNK_COLS; i++) {
+	int x = (start + i + WORLD_WIDTH) % WORLD_WIDTH;
+	held |= 1ULL << (stripeOf(x) - game->stripes);
+    }
+    for (int i = 0; i < NSTRIPES; i++) {
+	if (held >> i & 1) lock(game->stripes + i);
+    }
+    memcpy(game->layout + start, chunk->heights,
+		    sizeof *chunk->heights * CHUNK_COLS);
+    for (int i = -1; i <= CHUNK_COLS; i++) {
+	drawColumn((start + i + WORLD_WIDTH) % WORLD_WIDTH);
+    }
+    pthread_mutex_lock(&game->skylineLock);
+    for (int i = 0; i < CHUNK_COLS; i++) updateSkyline(start + i);
+    if (!game->attacker->tickEngine) updateRoof();
+    pthread_mutex_unlock(&game->skylineLock);
+    for (int i = NSTRIPES - 1; i >= 0; i--) {
+	if (held >> i & 1) unlock(game->stripes + i);
+    }
+    chunk->shown = chunk->seq;
+    int pending = 0;
+    for (int i = 0; i < stream->nslots; i++) {
+	pending += stream->slots[i].seq != stream->slots[i].shown;
+    }
+    atomic_store_explicit(&stream->pending, pending, memory_order_relaxed);
+}
+
+/**
+ * Show the chunks of an endless city the loader has staged. Called by
+ * the tick engine at the start of a tick, since its step kernel reads the
+ * layout without locking. In lockstep, a chunk is shown CHUNK_LEAD ticks
+ * after it was wanted so a replay sees the city change on the same
+ * ticks. The loader has those ticks to stage it; if it is still late, as
+ * a slow level file or ticks run back to back can make it, the tick
+ * waits for it.
+ *
+ * @param tick tick about to run, unused unless in lockstep
+ */
+void showChunks(unsigned tick) {
+    struct Stream *stream = game->stream;
+    if (atomic_load_explicit(&stream->pending, memory_order_relaxed) == 0) {
+	return;
+    }
+    pthread_mutex_lock(&stream->lock);
+    for (int i = 0; i < stream->nslots; i++) {
+	struct Chunk *chunk = stream->slots + i;
+	if (chunk->seq == chunk->shown) continue;
+	if (game->lockstep) {
+	    if (chunk->deadline == 0) chunk->deadline = tick + CHUNK_LEAD;
+	    if (tick < chunk->deadline) continue;
+	    while (chunk->staged != chunk->seq && !stream->stop) {
+		pthread_cond_wait(&stream->staged, &stream->lock);
+	    }
+	}
+	if (chunk->staged == chunk->seq) showChunk(stream, i);
+    }
+    pthread_mutex_unlock(&stream->lock);
+}
+
+/**
+ * Function for the loader thread of an endless city. Fills each slot
+ * handed to it with the chunk wanted there, reading the level file or
+ * generating buildings off the tick loop. The missile thread engine shows
+ * each chunk here; the tick engine shows them itself.
+ *
+ * @param match game whose city goes on
+ * @return NULL
+ */
+void *startLoader(void *match) {
+    game = match;
+    countThread("loader");
+    struct Stream *stream = game->stream;
+    pthread_mutex_lock(&stream->lock);
+    while (!stream->stop) {
+	struct Chunk *chunk = NULL;
+	for (int i = 0; i < stream->nslots && chunk == NULL; i++) {
+	    struct Chunk *c = stream->slots + i;
+	    if (c->seq != c->shown && c->staged != c->seq) chunk = c;
+	}
+	if (chunk == NULL) {
+	    pthread_cond_wait(&stream->wake, &stream->lock);
+	    continue;
+	}
+	long n = chunk->seq;
+	chunk->staged = -1;
+	pthread_mutex_unlock(&stream->lock);
+	_Bool read = fillChunk(stream, n, chunk->heights);
+	pthread_mutex_lock(&stream->lock);
+	if (!read) {
+	    postError("loader", strerror((errno) ? errno: EIO));
+	    stream->stop = 1;
+	    break;
+	}
+	chunk->staged = n;
+	pthread_cond_broadcast(&stream->staged);
+	if (!game->attacker->tickEngine) {
+	    showChunk(stream, chunk - stream->slots);
+	}
+    }
+    pthread_cond_broadcast(&stream->staged);
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+/**
+ * Start the loader thread of an endless city, if the city is endless
+ *
+ * @param game game whose city goes on
+ * @return 0 if the thread could not be started
+ *         1 if successful
+ */
+int startStream(struct Game *game) {
+    struct Stream *stream = game->stream;
+    if (stream == NULL) return 1;
+    int err = pthread_create(&stream->loader, NULL, startLoader, game);
+    if (err) errno = err;
+    stream->started = err == 0;
+    return stream->started;
+}
+
+/**
+ * Stop the loader thread of an endless city, if it was started
+ *
+ * @param game game whose city goes on
+ */
+void stopStream(struct Game *game) {
+    struct Stream *stream = game->stream;
+    if (stream == NULL || !stream->started) return;
+    pthread_mutex_lock(&stream->lock);
+    stream->stop = 1;
+    pthread_cond_signal(&stream->wake);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->loader, NULL);
+    stream->started = 0;
+}
+
+/**
+ * Advance the missile at row y of a column by one row and resolve
+ * collisions against the collision grid, city layout and shield. A
+ * missile only touches its own column, so the caller need only hold the
+ * stripe lock of that column.
+ *
+ * @param x world col of missile
+ * @param y row of missile
+ * @param clear 1 if the missile is known not to reach the city; the
+ *        shield row is tested all the same, since a shield may move into
+ *        the column after the missile was classified
+ * @return 0 if missile is still falling
+ *         1 if missile exploded or left the screen
+ */
+int advanceMissile(int x, int y, _Bool clear) {
+    if (y < HEIGHT) {
+	game->sky[(size_t) y * WORLD_WIDTH + x]--;
+	showCell(y, x);
+    }
+    y++;
+    _Bool exploded = 0;
+    if (y == game->defender->shieldY && testCol(game->shielded, x)) {
+	exploded = 1;
+	tally(&mine->blocked, 1);
+    } else if (y < HEIGHT && testCol(game->blasts + (size_t) y * ROW_WORDS,
+			    x) &&
+	    y < HEIGHT - atomic_load_explicit(&game->roof,
+		    memory_order_relaxed)) {
+	exploded = 1;
+    } else if (!clear && y == HEIGHT - ((x > game->size - 1) ?
+			    2: game->layout[x]) + 1) {
+	exploded = 1;
+	tally(&mine->cityHits, 1);
+	if (x < game->size && game->layout[x] > 2) {
+	    game->layout[x]--;
+	    lowerColumn(x);
+	}
+    } else if (y < HEIGHT) {
+	enterCell(y, x);
+    }
+    if (exploded) {
+	if (y < HEIGHT) putCell(y, x, '*');
+	if (y <= HEIGHT) putCell(y - 1, x, '?');
+	return 1;
+    }
+    if (y < HEIGHT) {
+	game->sky[(size_t) y * WORLD_WIDTH + x]++;
+	showCell(y, x);
+    }
+    return y > HEIGHT;
+}
+
+/**
+ * Advance a missile by one row, see advanceMissile
+ *
+ * @param nmissile missile to advance
+ * @return 0 if missile is still falling
+ *         1 if missile exploded or left the screen
+ */
+int stepMissile(struct Missile *nmissile) {
+    return advanceMissile(nmissile->x, nmissile->y++, 0);
+}
+
+/**
+ * Compare two timespecs
+ *
+ * @return negative, zero, or positive if a is before, equal to, or after b
+ */
+int timeCmp(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec) return (a->tv_sec < b->tv_sec) ? -1: 1;
+    if (a->tv_nsec != b->tv_nsec) return (a->tv_nsec < b->tv_nsec) ? -1: 1;
+    return 0;
+}
+
+/**
+ * Get the missile a handle names
+ *
+ * @param q queue that owns the pool
+ * @param h handle of missile
+ * @return missile, NULL if h is stale or NO_MISSILE
+ */
+struct Missile *missileAt(struct MissileQueue *q, uint32_t h) {
+    struct Missile *m = q->slots + (h & HANDLE_INDEX_MASK);
+    return (h != NO_MISSILE && m->handle == h) ? m: NULL;
+}
+
+/**
+ * Take a missile from the pool. The missile starts at the top of the sky.
+ * Caller must hold q->lock.
+ *
+ * @param q queue that owns the pool
+ * @param x world col of missile
+ * @param speed ticks per row, for the tick engine
+ * @return missile, NULL if the pool is empty
+ */
+struct Missile *takeMissile(struct MissileQueue *q, int x, int speed) {
+    struct Missile *m = missileAt(q, q->free);
+    if (m == NULL) return NULL;
+    q->free = m->next;
+    m->x = x;
+    m->y = 2;
+    m->speed = speed;
+    m->next = NO_MISSILE;
+    return m;
+}
+
+/**
+ * Take a missile from the pool and queue it for launch, waiting until a
+ * slot is free. The missile starts at the top of the sky.
+ *
+ * @param q queue of launched missiles
+ * @param x world col of missile
+ * @param speed ticks per row, for the tick engine
+ * @return 0 if the queue was closed by stopGame while waiting
+ *         1 if the missile was launched
+ */
+_Bool launchMissile(struct MissileQueue *q, int x, int speed) {
+    pthread_mutex_lock(&q->lock);
+    while (q->free == NO_MISSILE && !q->closed) {
+	pthread_cond_wait(&q->space, &q->lock);
+    }
+    if (q->free == NO_MISSILE) {
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+    }
+    struct Missile *m = takeMissile(q, x, speed);
+    uint32_t h = m->handle;
+    if (q->tail != NO_MISSILE) missileAt(q, q->tail)->next = h;
+    else q->head = h;
+    q->tail = h;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+/**
+ * Return a landed missile's slot to the pool. Caller must hold q->lock
+ * and signal q->space.
+ *
+ * @param q queue that owns the pool
+ * @param h handle of missile
+ */
+void freeMissile(struct MissileQueue *q, uint32_t h) {
+    struct Missile *m = missileAt(q, h);
+    m->handle += 1u << HANDLE_INDEX_BITS;
+    if (m->handle >> HANDLE_INDEX_BITS == 0) {
+	m->handle += 1u << HANDLE_INDEX_BITS;
+    }
+    m->next = q->free;
+    q->free = m->handle;
+}
+
+/**
+ * Function for a missile worker thread. Takes missiles from the queue and
+ * flies every missile it holds until each explodes or leaves the screen.
+ * Exits once the queue is closed and its missiles have landed, or at once
+ * when the game is stopped.
+ *
+ * @param queue queue of launched missiles
+ * @return NULL
+ */
+void *missileWorker(void *queue) {
+    struct MissileQueue *q = queue;
+    game = q->game;
+    countThread("worker");
+    seedThread(16 + atomic_fetch_add(&q->workerIds, 1));
+    uint32_t flying = NO_MISSILE;
+    struct timespec now;
+    for (;;) {
+	pthread_mutex_lock(&q->lock);
+	while (flying == NO_MISSILE && q->head == NO_MISSILE && !q->closed) {
+	    pthread_cond_wait(&q->ready, &q->lock);
+	}
+	if (game->stopped || (flying == NO_MISSILE && q->head == NO_MISSILE)) {
+	    pthread_mutex_unlock(&q->lock);
+	    break;
+	}
+	if (flying != NO_MISSILE) {
+	    struct Missile *m = missileAt(q, flying);
+	    struct timespec *due = &m->due;
+	    while ((m = missileAt(q, m->next)) != NULL) {
+		if (timeCmp(&m->due, due) < 0) due = &m->due;
+	    }
+	    while (q->head == NO_MISSILE && !game->stopped &&
+			    pthread_cond_timedwait(&q->ready, &q->lock,
+				    due) != ETIMEDOUT);
+	}
+	struct Missile *nmissile = missileAt(q, q->head);
+	if (nmissile) {
+	    q->head = nmissile->next;
+	    if (q->head == NO_MISSILE) q->tail = NO_MISSILE;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	if (nmissile) {
+	    lock(stripeOf(nmissile->x));
+	    placeMissile(nmissile);
+	    unlock(stripeOf(nmissile->x));
+	    deadline(&nmissile->due, rngRange(MAX_DELAY_MS));
+	    nmissile->next = flying;
+	    flying = nmissile->handle;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint32_t *link = &flying;
+	while (*link != NO_MISSILE) {
+	    struct Missile *m = missileAt(q, *link);
+	    if (timeCmp(&m->due, &now) > 0) {
+		link = &m->next;
+		continue;
+	    }
+	    lock(stripeOf(m->x));
+	    int done = stepMissile(m);
+	    unlock(stripeOf(m->x));
+	    if (!done) {
+		deadline(&m->due, rngRange(MAX_DELAY_MS));
+		link = &m->next;
+		continue;
+	    }
+	    *link = m->next;
+	    atomic_fetch_add_explicit(&bench.landed, 1, memory_order_relaxed);
+	    pthread_mutex_lock(&q->lock);
+	    freeMissile(q, m->handle);
+	    pthread_cond_signal(&q->space);
+	    pthread_mutex_unlock(&q->lock);
+	}
+    }
+    return NULL;
+}
+
+/**
+ * Get the height the city has in a world column
+ *
+ * @param x world col
+ * @return height of building, 2 past the end of the layout
+ */
+int heightAt(int x) {
+    return (x < game->size) ? game->layout[x]: 2;
+}
+
+/**
+ * Step kernel for swarm missiles from index i on, one at a time
+ *
+ * @param swarm missiles in flight
+ * @param i first missile to step
+ */
+void stepFrom(struct Swarm *swarm, int i) {
+    int shieldY = game->defender->shieldY;
+    for (; i < swarm->n; i++) {
+	if (--swarm->wait[i] != 0) {
+	    swarm->event[i] = STEP_WAIT;
+	    continue;
+	}
+	swarm->wait[i] = swarm->speed[i];
+	int x = swarm->x[i];
+	int y = swarm->y[i] + 1;
+	swarm->event[i] = (y == shieldY || y == HEIGHT - heightAt(x) + 1) ?
+		STEP_CHECK: STEP_CLEAR;
+    }
+}
+
+/**
+ * Portable step kernel
+ *
+ * @param swarm missiles in flight
+ */
+void stepScalar(struct Swarm *swarm) {
+    stepFrom(swarm, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Step kernel for four missiles at a time with SSE2. SSE2 has no gather,
+ * so building heights are loaded one lane at a time.
+ *
+ * @param swarm missiles in flight
+ */
+__attribute__((target("sse2")))
+void stepSse2(struct Swarm *swarm) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i shieldY = _mm_set1_epi32(game->defender->shieldY);
+    const __m128i ground = _mm_set1_epi32(HEIGHT + 1);
+    int i = 0;
+    for (; i + 4 <= swarm->n; i += 4) {
+	__m128i w = _mm_sub_epi32(
+			_mm_loadu_si128((__m128i *) (swarm->wait + i)), one);
+	__m128i due = _mm_cmpeq_epi32(w, zero);
+	__m128i speed = _mm_loadu_si128((__m128i *) (swarm->speed + i));
+	_mm_storeu_si128((__m128i *) (swarm->wait + i),
+			_mm_or_si128(_mm_and_si128(due, speed),
+				_mm_andnot_si128(due, w)));
+	const int *xs = swarm->x + i;
+	__m128i y = _mm_add_epi32(
+			_mm_loadu_si128((__m128i *) (swarm->y + i)), one);
+	__m128i h = _mm_setr_epi32(heightAt(xs[0]), heightAt(xs[1]),
+			heightAt(xs[2]), heightAt(xs[3]));
+	__m128i city = _mm_cmpeq_epi32(y, _mm_sub_epi32(ground, h));
+	__m128i shield = _mm_cmpeq_epi32(y, shieldY);
+	__m128i hit = _mm_and_si128(due, _mm_or_si128(city, shield));
+	// masks are -1, so this is due ? (hit ? 2: 1): 0
+	_mm_storeu_si128((__m128i *) (swarm->event + i),
+			_mm_sub_epi32(_mm_sub_epi32(zero, due), hit));
+    }
+    stepFrom(swarm, i);
+}
+
+/**
+ * Step kernel for eight missiles at a time with AVX2, gathering building
+ * heights straight from the layout. The gather loads 4 bytes at each
+ * height, so the layout is allocated LAYOUT_PAD bytes long.
+ *
+ * @param swarm missiles in flight
+ */
+__attribute__((target("avx2")))
+void stepAvx2(struct Swarm *swarm) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i two = _mm256_set1_epi32(2);
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    const __m256i size = _mm256_set1_epi32(game->size);
+    const __m256i shieldY = _mm256_set1_epi32(game->defender->shieldY);
+    const __m256i ground = _mm256_set1_epi32(HEIGHT + 1);
+    int i = 0;
+    for (; i + 8 <= swarm->n; i += 8) {
+	__m256i w = _mm256_sub_epi32(
+			_mm256_loadu_si256((__m256i *) (swarm->wait + i)), one);
+	__m256i due = _mm256_cmpeq_epi32(w, zero);
+	__m256i speed = _mm256_loadu_si256((__m256i *) (swarm->speed + i));
+	_mm256_storeu_si256((__m256i *) (swarm->wait + i),
+			_mm256_blendv_epi8(w, speed, due));
+	__m256i x = _mm256_loadu_si256((__m256i *) (swarm->x + i));
+	__m256i y = _mm256_add_epi32(
+			_mm256_loadu_si256((__m256i *) (swarm->y + i)), one);
+	__m256i h = _mm256_and_si256(low, _mm256_mask_i32gather_epi32(two,
+				(const int *) game->layout, x,
+				_mm256_cmpgt_epi32(size, x), 1));
+	__m256i city = _mm256_cmpeq_epi32(y, _mm256_sub_epi32(ground, h));
+	__m256i shield = _mm256_cmpeq_epi32(y, shieldY);
+	__m256i hit = _mm256_and_si256(due, _mm256_or_si256(city, shield));
+	_mm256_storeu_si256((__m256i *) (swarm->event + i),
+			_mm256_sub_epi32(_mm256_sub_epi32(zero, due), hit));
+    }
+    stepFrom(swarm, i);
+}
+#elif defined(__aarch64__)
+/**
+ * Step kernel for four missiles at a time with NEON. NEON has no gather,
+ * so building heights are loaded one lane at a time.
+ *
+ * @param swarm missiles in flight
+ */
+void stepNeon(struct Swarm *swarm) {
+    const int32x4_t one = vdupq_n_s32(1);
+    const uint32x4_t flag = vdupq_n_u32(1);
+    const int32x4_t shieldY = vdupq_n_s32(game->defender->shieldY);
+    const int32x4_t ground = vdupq_n_s32(HEIGHT + 1);
+    int i = 0;
+    for (; i + 4 <= swarm->n; i += 4) {
+	int32x4_t w = vsubq_s32(vld1q_s32(swarm->wait + i), one);
+	uint32x4_t due = vceqq_s32(w, vdupq_n_s32(0));
+	vst1q_s32(swarm->wait + i,
+			vbslq_s32(due, vld1q_s32(swarm->speed + i), w));
+	const int *xs = swarm->x + i;
+	int32x4_t y = vaddq_s32(vld1q_s32(swarm->y + i), one);
+	int hs[4] = { heightAt(xs[0]), heightAt(xs[1]), heightAt(xs[2]),
+		heightAt(xs[3]) };
+	uint32x4_t city = vceqq_s32(y, vsubq_s32(ground, vld1q_s32(hs)));
+	uint32x4_t shield = vceqq_s32(y, shieldY);
+	uint32x4_t hit = vandq_u32(due, vorrq_u32(city, shield));
+	vst1q_s32(swarm->event + i, vreinterpretq_s32_u32(vaddq_u32(
+				vandq_u32(due, flag), vandq_u32(hit, flag))));
+    }
+    stepFrom(swarm, i);
+}
+#endif
+
+/**
+ * Pick the widest step kernel this CPU supports
+ *
+ * @param name set to name of kernel
+ * @return step kernel
+ */
+StepKernel *pickKernel(const char **name) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	*name = "avx2";
+	return stepAvx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+	*name = "sse2";
+	return stepSse2;
+    }
+#elif defined(__aarch64__)
+    *name = "neon";
+    return stepNeon;
+#endif
+    *name = "scalar";
+    return stepScalar;
+}
+
+/**
+ * Pick the step kernel of every tick engine, once
+ */
+void pickStep(void) {
+    stepKernel = pickKernel(&bench.kernel);
+}
+
+/**
+ * Hash the parts of a game's config that change how a battle plays out,
+ * including the level file an endless city goes on with
+ *
+ * @param game game loaded from a config file
+ * @return FNV-1a hash
+ */
+uint32_t configHash(struct Game *game) {
+    int fields[2] = { game->attacker->totalMissiles, game->size };
+    uint32_t hash = fnv1a(2166136261u, fields, sizeof fields);
+    hash = fnv1a(hash, game->layout, sizeof *game->layout * game->size);
+    if (game->settings) {
+	hash = fnv1a(hash, game->settings, strlen(game->settings));
+    }
+    if (game->stream && game->stream->fd != -1) {
+	hash = fnv1a(hash, &game->stream->identity,
+			sizeof game->stream->identity);
+    }
+    return hash;
+}
+
+/**
+ * Write an unsigned LEB128 varint
+ *
+ * @param p buffer with room for 10 bytes
+ * @param v value to write
+ * @return number of bytes written
+ */
+size_t putVarint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    do {
+	p[n++] = (v > 0x7f) ? (v & 0x7f) | 0x80: v;
+	v >>= 7;
+    } while (v);
+    return n;
+}
+
+/**
+ * Read an unsigned LEB128 varint of up to 42 bits
+ *
+ * @param p buffer to read
+ * @param len bytes in buffer
+ * @param pos offset of varint, moved past it
+ * @param v set to value read
+ * @return 0 if buffer ends first or varint is too long
+ *         1 if successful
+ */
+int getVarint(const unsigned char *p, size_t len, size_t *pos, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; ; shift += 7) {
+	if (*pos >= len || shift > 35) return 0;
+	unsigned char b = p[(*pos)++];
+	*v |= (uint64_t) (b & 0x7f) << shift;
+	if (!(b & 0x80)) return 1;
+    }
+}
 
-		if (strInt(token, game->layout + game->size)) {
-		    if (game->layout[game->size] > game->tallest) {
-			game->tallest = game->layout[game->size];
-		    }
-		    game->size++;
+/**
+ * Append an event to the replay log
+ *
+ * @param tick tick the event happened on
+ * @param code EVENT_* code
+ */
+void recordEvent(unsigned tick, int code) {
+    unsigned char buf[10];
+    fwrite(buf, 1, putVarint(buf,
+			    (uint64_t) (tick - game->recordTick) << 2 | code),
+		    game->recordFile);
+    game->recordTick = tick;
+}
+
+/**
+ * Append a shield move to the replay log, selecting the shield first if
+ * the last move was by another one
+ *
+ * @param tick tick the move was applied on
+ * @param s index of shield
+ * @param code EVENT_LEFT or EVENT_RIGHT
+ */
+void recordMove(unsigned tick, int s, int code) {
+    if (s != game->recordShield) {
+	unsigned char buf[10];
+	fwrite(buf, 1, putVarint(buf, (uint64_t) s << 2 | EVENT_SHIELD),
+			game->recordFile);
+	game->recordShield = s;
+    }
+    recordEvent(tick, code);
+}
+
+/**
+ * Read the next event of the replay log
+ *
+ * @param tick set to tick of event
+ * @param code set to EVENT_LEFT, EVENT_RIGHT or EVENT_END; replay.shield
+ *        is set to the shield a move is by
+ * @return 0 at end of log
+ *         1 if successful
+ */
+int replayEvent(unsigned *tick, int *code) {
+    uint64_t v;
+    do {
+	if (!getVarint(game->replay.data, game->replay.len, &game->replay.pos,
+				&v)) {
+	    return 0;
+	}
+	if ((v & 3) == EVENT_SHIELD) {
+	    game->replay.shield = (v >> 2 < MAX_SHIELDS) ? (int) (v >> 2):
+		    MAX_SHIELDS;
+	}
+    } while ((v & 3) == EVENT_SHIELD);
+    game->replay.tick += v >> 2;
+    *tick = game->replay.tick;
+    *code = v & 3;
+    return 1;
+}
+
+/**
+ * Start flying a missile in the tick engine
+ *
+ * @param swarm missiles in flight
+ * @param m missile taken from the pool
+ */
+void adoptMissile(struct Swarm *swarm, struct Missile *m) {
+    lock(stripeOf(m->x));
+    placeMissile(m);
+    unlock(stripeOf(m->x));
+    swarm->x[swarm->n] = m->x;
+    swarm->y[swarm->n] = m->y;
+    swarm->speed[swarm->n] = swarm->wait[swarm->n] = m->speed;
+    swarm->handle[swarm->n++] = m->handle;
+}
+
+/**
+ * Aim the attacker's next missile, for the attack thread and the tick
+ * engine alike: a random world col, and a random speed of 1 up to
+ * MAX_DELAY_MS worth of ticks per row
+ *
+ * @param attacker attacker launching the missile
+ * @param x set to world col of missile
+ * @param speed set to ticks per row of missile
+ */
+void aimMissile(const struct Attacker *attacker, int *x, int *speed) {
+    *x = rngRange(WORLD_WIDTH);
+    int maxSpeed = MAX_DELAY_MS / attacker->tickMs;
+    *speed = 1 + rngRange((maxSpeed > 0) ? maxSpeed: 1);
+}
+
+/**
+ * Count a missile launched, and the attacker's missiles left
+ *
+ * @param attacker attacker that launched the missile
+ * @return 1 if it was the attacker's last missile
+ */
+_Bool countLaunch(struct Attacker *attacker) {
+    tally(&mine->launched, 1);
+    return attacker->totalMissiles > 0 && --attacker->totalMissiles == 0;
+}
+
+/**
+ * Get the ticks before the tick engine launches the next missile in
+ * lockstep, drawn like the attacker's delay
+ *
+ * @return ticks to wait
+ */
+unsigned launchDelay(void) {
+    return rngRange(MAX_DELAY_MS * 3) / game->attacker->tickMs;
+}
+
+/**
+ * Get the game time from one launch to the next for an attacker with a
+ * rate. Steady launches at rate throughout. Ramp climbs from a tenth of
+ * rate to rate over the first period, then holds. Spike launches at
+ * SPIKE_FACTOR times rate for the first tenth of every period.
+ *
+ * @param attacker attacker with rate > 0
+ * @param ms game time of the launch since the battle began
+ * @return nanoseconds of game time until the next launch
+ */
+long launchGap(const struct Attacker *attacker, long long ms) {
+    double rate = attacker->rate;
+    if (attacker->profile == PROFILE_RAMP && ms < attacker->periodMs) {
+	rate *= 0.1 + 0.9 * ms / attacker->periodMs;
+    } else if (attacker->profile == PROFILE_SPIKE &&
+		    ms % attacker->periodMs < attacker->periodMs / 10) {
+	rate *= SPIKE_FACTOR;
+    }
+    long gap = 1e9 / rate;
+    return (gap > 0) ? gap: 1;
+}
+
+/**
+ * Push a task on the bottom of the owner's deque
+ *
+ * @param d deque of this worker
+ * @param task task to push
+ */
+void dequePush(struct Deque *d, int task) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    atomic_store_explicit(d->tasks + b % d->cap, task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+/**
+ * Take a task from the bottom of the owner's deque
+ *
+ * @param d deque of this worker
+ * @return task, NO_TASK if empty
+ */
+int dequeTake(struct Deque *d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) {
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	return NO_TASK;
+    }
+    int task = atomic_load_explicit(d->tasks + b % d->cap,
+		    memory_order_relaxed);
+    if (t == b) {
+	// last task; race thieves for it
+	if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+				memory_order_seq_cst, memory_order_relaxed)) {
+	    task = NO_TASK;
+	}
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/**
+ * Steal a task from the top of another worker's deque
+ *
+ * @param d deque of another worker
+ * @return task, NO_TASK if empty, LOST_TASK if another worker won it
+ */
+int dequeSteal(struct Deque *d) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) return NO_TASK;
+    int task = atomic_load_explicit(d->tasks + t % d->cap,
+		    memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+			    memory_order_seq_cst, memory_order_relaxed)) {
+	return LOST_TASK;
+    }
+    return task;
+}
+
+/**
+ * Resolve the moves of one task in order under its stripe lock
+ *
+ * @param crew workers of the tick engine
+ * @param task task to run
+ */
+void runTask(struct Crew *crew, int task) {
+    struct Swarm *swarm = crew->swarm;
+    int *order = crew->order;
+    struct Lock *stripe = stripeOf(swarm->x[order[crew->first[task]]]);
+    lock(stripe);
+    for (int k = crew->first[task]; k < crew->first[task + 1]; k++) {
+	int i = order[k];
+	int x = swarm->x[i];
+	_Bool clear = swarm->event[i] == STEP_CLEAR &&
+		crew->razed[x] != crew->tick;
+	if (advanceMissile(x, swarm->y[i]++, clear)) {
+	    crew->razed[x] = crew->tick;
+	    swarm->event[i] = STEP_LANDED;
+	}
+    }
+    unlock(stripe);
+}
+
+/**
+ * Hint to the CPU that this thread is spinning
+ */
+void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile ("yield");
+#endif
+}
+
+/**
+ * Run this tick's tasks as one worker: push this worker's share on its
+ * deque, work through it, then steal from the others until every task is
+ * done
+ *
+ * @param crew workers of the tick engine
+ * @param me number of this worker
+ */
+void runTasks(struct Crew *crew, int me) {
+    struct Deque *own = crew->deques + me;
+    for (int t = me; t < crew->ntasks; t += crew->size) dequePush(own, t);
+    int victim = me;
+    while (atomic_load_explicit(&crew->remaining, memory_order_acquire) > 0) {
+	int task = dequeTake(own);
+	int backoff = 1;
+	while (task < 0 && atomic_load_explicit(&crew->remaining,
+				memory_order_acquire) > 0) {
+	    victim = (victim + 1) % crew->size;
+	    if (victim != me) {
+		task = dequeSteal(crew->deques + victim);
+	    } else if (backoff <= MAX_BACKOFF) {
+		// nothing to steal this round: pause twice as long each time
+		for (int i = 0; i < backoff; i++) cpuRelax();
+		backoff *= 2;
+	    } else {
+		sched_yield();
+	    }
+	}
+	if (task < 0) break;
+	runTask(crew, task);
+	atomic_fetch_sub_explicit(&crew->remaining, 1, memory_order_release);
+    }
+}
+
+/**
+ * Function for a tick engine helper thread. Runs tasks with the engine
+ * each tick until the crew is stopped.
+ *
+ * @param crew workers of the tick engine
+ * @return NULL
+ */
+void *tickHelper(void *crew) {
+    struct Crew *ncrew = crew;
+    game = ncrew->game;
+    countThread("engine");
+    int me = 1 + atomic_fetch_add(&ncrew->ids, 1);
+    unsigned seen = 0;
+    for (;;) {
+	pthread_mutex_lock(&ncrew->lock);
+	while (ncrew->generation == seen && !ncrew->stop) {
+	    pthread_cond_wait(&ncrew->go, &ncrew->lock);
+	}
+	if (ncrew->stop) {
+	    pthread_mutex_unlock(&ncrew->lock);
+	    break;
+	}
+	seen = ncrew->generation;
+	pthread_mutex_unlock(&ncrew->lock);
+	runTasks(ncrew, me);
+	pthread_mutex_lock(&ncrew->lock);
+	if (--ncrew->busy == 0) pthread_cond_signal(&ncrew->idle);
+	pthread_mutex_unlock(&ncrew->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Allocate a crew and start its helper threads
+ *
+ * @param crew crew to start
+ * @param swarm missiles in flight
+ * @param limit most missiles in flight
+ * @param workers workers wanted, including the tick engine thread
+ * @return 0 if out of memory
+ *         1 if successful; crew->size may be less than workers
+ */
+int startCrew(struct Crew *crew, struct Swarm *swarm, int limit,
+		int workers) {
+    memset(crew, 0, sizeof *crew);
+    crew->game = game;
+    crew->swarm = swarm;
+    crew->nblocks = (WORLD_WIDTH + STRIPE_COLS - 1) / STRIPE_COLS;
+    crew->razed = calloc(WORLD_WIDTH, sizeof *crew->razed);
+    crew->count = malloc(sizeof *crew->count * crew->nblocks);
+    crew->first = malloc(sizeof *crew->first * (crew->nblocks + 1));
+    crew->order = malloc(sizeof *crew->order * limit);
+    // deques are cache line aligned so workers do not share lines; the
+    // size of one is a multiple of its alignment, as aligned_alloc needs
+    crew->deques = aligned_alloc(_Alignof(struct Deque),
+		    sizeof *crew->deques * workers);
+    if (crew->deques) memset(crew->deques, 0, sizeof *crew->deques * workers);
+    crew->rings = malloc(sizeof *crew->rings * workers * crew->nblocks);
+    crew->helpers = malloc(sizeof *crew->helpers * workers);
+    if (!crew->razed || !crew->count || !crew->first || !crew->order ||
+		    !crew->deques || !crew->rings || !crew->helpers) {
+	return 0;
+    }
+    for (int i = 0; i < workers; i++) {
+	crew->deques[i].cap = crew->nblocks;
+	crew->deques[i].tasks = crew->rings + (size_t) i * crew->nblocks;
+    }
+    pthread_mutex_init(&crew->lock, NULL);
+    pthread_cond_init(&crew->go, NULL);
+    pthread_cond_init(&crew->idle, NULL);
+    crew->size = 1;
+    while (crew->size < workers && pthread_create(crew->helpers +
+			    crew->size - 1, NULL, tickHelper, crew) == 0) {
+	crew->size++;
+    }
+    return 1;
+}
+
+/**
+ * Stop a crew's helper threads and free it
+ *
+ * @param crew crew to stop
+ */
+void stopCrew(struct Crew *crew) {
+    if (crew->size > 0) {
+	pthread_mutex_lock(&crew->lock);
+	crew->stop = 1;
+	pthread_cond_broadcast(&crew->go);
+	pthread_mutex_unlock(&crew->lock);
+	for (int i = 0; i < crew->size - 1; i++) {
+	    pthread_join(crew->helpers[i], NULL);
+	}
+	pthread_mutex_destroy(&crew->lock);
+	pthread_cond_destroy(&crew->go);
+	pthread_cond_destroy(&crew->idle);
+    }
+    free(crew->deques);
+    free(crew->rings);
+    free(crew->helpers);
+    free(crew->razed);
+    free(crew->count);
+    free(crew->first);
+    free(crew->order);
+}
+
+/**
+ * Resolve the moves the step kernel found due this tick. The moves are
+ * grouped by block of columns, keeping their order within a block, and
+ * each block is one task. When there are enough moves, the tasks are
+ * spread over the crew; a missile that lands is marked STEP_LANDED.
+ *
+ * @param crew workers of the tick engine
+ * @param tick number of this tick
+ */
+void resolveMoves(struct Crew *crew, unsigned tick) {
+    struct Swarm *swarm = crew->swarm;
+    crew->tick = tick;
+    memset(crew->count, 0, sizeof *crew->count * crew->nblocks);
+    int due = 0;
+    for (int i = 0; i < swarm->n; i++) {
+	if (swarm->event[i] != STEP_WAIT) {
+	    crew->count[swarm->x[i] / STRIPE_COLS]++;
+	    due++;
+	}
+    }
+    // count becomes the next free place of each block in order
+    crew->ntasks = 0;
+    for (int b = 0, at = 0; b < crew->nblocks; b++) {
+	int n = crew->count[b];
+	if (n > 0) crew->first[crew->ntasks++] = at;
+	crew->count[b] = at;
+	at += n;
+    }
+    crew->first[crew->ntasks] = due;
+    for (int i = 0; i < swarm->n; i++) {
+	if (swarm->event[i] != STEP_WAIT) {
+	    crew->order[crew->count[swarm->x[i] / STRIPE_COLS]++] = i;
+	}
+    }
+
+    if (crew->size == 1 || due < MIN_PARALLEL_MOVES) {
+	for (int t = 0; t < crew->ntasks; t++) runTask(crew, t);
+	return;
+    }
+    atomic_store(&crew->remaining, crew->ntasks);
+    pthread_mutex_lock(&crew->lock);
+    crew->busy = crew->size - 1;
+    crew->generation++;
+    pthread_cond_broadcast(&crew->go);
+    pthread_mutex_unlock(&crew->lock);
+    runTasks(crew, 0);
+    pthread_mutex_lock(&crew->lock);
+    while (crew->busy > 0) pthread_cond_wait(&crew->idle, &crew->lock);
+    pthread_mutex_unlock(&crew->lock);
+}
+
+/**
+ * Set up a tick engine: its swarm, its crew and, in lockstep, the first
+ * launch and replay event. Seeds this thread's random stream for the
+ * launches in lockstep. On failure, the engine still runs, but frees
+ * every missile it is handed.
+ *
+ * @param e engine to set up
+ * @param q queue of launched missiles
+ * @param workers workers wanted, including the tick engine thread
+ */
+void startEngine(struct Engine *e, struct MissileQueue *q, int workers) {
+    memset(e, 0, sizeof *e);
+    e->q = q;
+    e->tickMs = game->attacker->tickMs;
+    static pthread_once_t picked = PTHREAD_ONCE_INIT;
+    pthread_once(&picked, pickStep);
+    e->step = stepKernel;
+    e->swarm.x = malloc(sizeof *e->swarm.x * q->limit);
+    e->swarm.y = malloc(sizeof *e->swarm.y * q->limit);
+    e->swarm.speed = malloc(sizeof *e->swarm.speed * q->limit);
+    e->swarm.wait = malloc(sizeof *e->swarm.wait * q->limit);
+    e->swarm.event = malloc(sizeof *e->swarm.event * q->limit);
+    e->swarm.handle = malloc(sizeof *e->swarm.handle * q->limit);
+    e->landed = malloc(sizeof *e->landed * q->limit);
+    e->ready = startCrew(&e->crew, &e->swarm, q->limit, workers) &&
+	    e->swarm.x && e->swarm.y && e->swarm.speed && e->swarm.wait &&
+	    e->swarm.event && e->swarm.handle && e->landed;
+    if (!e->ready) {
+	postError("tickEngine", strerror(errno));
+    }
+    game->replay.shield = 0;
+    if (game->lockstep) {
+	seedThread(1);
+	if (game->attacker->rate > 0) {
+	    e->launchNs = launchGap(game->attacker, 0);
+	    e->nextLaunch = e->launchNs / 1000000 / e->tickMs;
+	} else {
+	    e->nextLaunch = launchDelay();
+	}
+	e->pending = game->replay.data &&
+		replayEvent(&e->eventTick, &e->event);
+    }
+}
+
+/**
+ * Run one tick of an engine: take the missiles launched since the last
+ * tick, apply the shield moves in lockstep, move every missile in flight,
+ * then free the ones that landed and, in lockstep, launch the next ones
+ *
+ * @param e engine of the match this thread works on
+ * @return 0 once a lockstep battle is over
+ *         1 otherwise
+ */
+_Bool engineTick(struct Engine *e) {
+    struct MissileQueue *q = e->q;
+    struct Swarm *swarm = &e->swarm;
+    if (game->lockstep && e->ended && swarm->n == 0) return 0;
+    pthread_mutex_lock(&q->lock);
+    uint32_t queued = q->head;
+    q->head = q->tail = NO_MISSILE;
+    pthread_mutex_unlock(&q->lock);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned tick = ++e->tick;
+    if (game->lockstep && game->replay.data) {
+	for (; e->pending && e->eventTick == tick;
+			e->pending = replayEvent(&e->eventTick, &e->event)) {
+	    if (e->event == EVENT_END) endGame();
+	    else if (game->replay.shield < game->defender->nshields) {
+		moveShield(game->defender, game->replay.shield,
+				(e->event == EVENT_LEFT) ? -1: 1);
+	    }
+	}
+    } else if (game->lockstep) {
+	struct Defender *defender = game->defender;
+	for (int s = 0; s < defender->nshields; s++) {
+	    int dir[KEY_QUEUE_LEN];
+	    int nkeys = takeKeys(&defender->shields[s].keys, dir);
+	    for (int i = 0; i < nkeys; i++) {
+		moveShield(defender, s, dir[i]);
+		if (game->recordFile) {
+		    recordMove(tick, s, (dir[i] < 0) ? EVENT_LEFT:
+				    EVENT_RIGHT);
 		}
-		token = strtok(NULL, " ");
 	    }
 	}
-	line++;
     }
-    if (str != NULL) free(str);
-    fclose(fp);
-    if (char_read == -1 && (errno == EINVAL || errno == ENOMEM)) {
-	perror("createGame");
+    if (game->lockstep && !e->ended && game->gameOver) {
+	e->ended = 1;
+	if (game->recordFile) recordEvent(tick, EVENT_END);
+    }
+    if (game->stream) showChunks(tick);
+    e->step(swarm);
+    if (e->ready) resolveMoves(&e->crew, tick);
+    pthread_mutex_lock(&game->skylineLock);
+    updateRoof();
+    pthread_mutex_unlock(&game->skylineLock);
+    int nlanded = 0;
+    int n = 0;
+    for (int i = 0; i < swarm->n; i++) {
+	if (swarm->event[i] == STEP_LANDED) {
+	    e->landed[nlanded++] = swarm->handle[i];
+	    continue;
+	}
+	if (n != i) {
+	    swarm->x[n] = swarm->x[i];
+	    swarm->y[n] = swarm->y[i];
+	    swarm->speed[n] = swarm->speed[i];
+	    swarm->wait[n] = swarm->wait[i];
+	    swarm->handle[n] = swarm->handle[i];
+	}
+	n++;
+    }
+    swarm->n = n;
+    struct Missile *m;
+    while ((m = missileAt(q, queued)) != NULL) {
+	queued = m->next;
+	if (!e->ready) {
+	    pthread_mutex_lock(&q->lock);
+	    freeMissile(q, m->handle);
+	    pthread_cond_signal(&q->space);
+	    pthread_mutex_unlock(&q->lock);
+	    continue;
+	}
+	adoptMissile(swarm, m);
+    }
+    while (game->lockstep && e->ready && !e->ended && tick >= e->nextLaunch) {
+	struct Attacker *attacker = game->attacker;
+	int x, speed;
+	aimMissile(attacker, &x, &speed);
+	pthread_mutex_lock(&q->lock);
+	m = takeMissile(q, x, speed);
+	pthread_mutex_unlock(&q->lock);
+	if (m) {
+	    // a full pool delays the launch to a later tick
+	    adoptMissile(swarm, m);
+	    if (attacker->rate > 0) {
+		// several launches may fall in one tick
+		e->launchNs += launchGap(attacker, e->launchNs / 1000000);
+		e->nextLaunch = e->launchNs / 1000000 / e->tickMs;
+	    } else {
+		unsigned delay = launchDelay();
+		e->nextLaunch = tick + ((delay > 0) ? delay: 1);
+	    }
+	    if (countLaunch(attacker)) {
+		e->ended = 1;
+		endGame();
+	    }
+	} else {
+	    e->nextLaunch = tick + 1;
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    histAdd(&bench.tick, elapsedNs(&start, &end));
+
+    if (nlanded) {
+	atomic_fetch_add_explicit(&bench.landed, nlanded,
+			memory_order_relaxed);
+	pthread_mutex_lock(&q->lock);
+	for (int i = 0; i < nlanded; i++) freeMissile(q, e->landed[i]);
+	pthread_cond_broadcast(&q->space);
+	pthread_mutex_unlock(&q->lock);
+    }
+    return 1;
+}
+
+/**
+ * Free an engine's swarm and stop its crew
+ *
+ * @param e engine to stop
+ */
+void stopEngine(struct Engine *e) {
+    free(e->swarm.x);
+    free(e->swarm.y);
+    free(e->swarm.speed);
+    free(e->swarm.wait);
+    free(e->swarm.event);
+    free(e->swarm.handle);
+    free(e->landed);
+    stopCrew(&e->crew);
+}
+
+/**
+ * Function for the tick engine thread. Advances every missile in flight
+ * once per fixed timestep; a missile moves one row each time its speed
+ * (in ticks) elapses. Each tick, the step kernel counts down every
+ * missile and flags the ones that may hit the city or shield, then the
+ * moves are resolved by the crew, in order within each column. Once a
+ * missile explodes in a column, later moves in that column this tick are
+ * checked in full, since the kernel saw the city before it was hit.
+ * Landings and launches are then handled by this thread alone.
+ *
+ * In lockstep, the engine also launches the missiles and applies the
+ * shield moves, at tick boundaries, so a battle depends only on the seed
+ * and the moves logged with the tick they were applied on.
+ *
+ * @param queue queue of launched missiles
+ * @return NULL
+ */
+void *tickEngine(void *queue) {
+    struct MissileQueue *q = queue;
+    game = q->game;
+    countThread("engine");
+    int workers = game->attacker->workers;
+    if (workers == 0) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	workers = (n > 0) ? n: 1;
+    }
+    struct Engine e;
+    startEngine(&e, q, workers);
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (;;) {
+	if (e.swarm.n == 0 && !game->lockstep) {
+	    pthread_mutex_lock(&q->lock);
+	    while (q->head == NO_MISSILE && !q->closed) {
+		pthread_cond_wait(&q->ready, &q->lock);
+	    }
+	    _Bool done = q->head == NO_MISSILE;
+	    pthread_mutex_unlock(&q->lock);
+	    if (done) break;
+	    clock_gettime(CLOCK_MONOTONIC, &next);
+	}
+	if (!engineTick(&e)) break;
+	// a stopped game drops its missiles, unless a log is being recorded:
+	// its replay flies them until they land, so the run does too, without
+	// sleeping between ticks
+	if (game->stopped && !game->recordFile) break;
+
+	if (game->fastForward) continue;
+	addTime(&next, e.tickMs * 1000000 / speedup);
+	nap(&next, &game->stopped);
+    }
+    stopEngine(&e);
+    return NULL;
+}
+
+/**
+ * Set up the queue of launched missiles and its pool of missiles. The
+ * pool holds the attacker's inflight limit, or a quarter of the board's
+ * width up to 8 missiles.
+ *
+ * @param q queue to set up
+ * @param attacker attacker launching into it
+ * @return 0 if out of memory; the pool is then empty
+ *         1 if successful
+ */
+int createQueue(struct MissileQueue *q, const struct Attacker *attacker) {
+    *q = (struct MissileQueue) {
+	.game = game,
+	.head = NO_MISSILE,
+	.tail = NO_MISSILE,
+	.slots = NULL,
+	.free = NO_MISSILE,
+	.limit = (attacker->inflight > 0) ? attacker->inflight:
+	    (WIDTH > 32) ? 8: ((WIDTH / 4 == 0) ? WIDTH: WIDTH / 4),
+	.closed = 0,
+	.workerIds = 0
+    };
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->space, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->ready, &attr);
+    pthread_condattr_destroy(&attr);
+    if (q->limit > (int) HANDLE_INDEX_MASK) q->limit = HANDLE_INDEX_MASK;
+    q->slots = malloc(sizeof *q->slots * q->limit);
+    if (q->slots == NULL) {
+	q->limit = 0;
+	return 0;
+    }
+    for (int i = q->limit - 1; i >= 0; i--) {
+	q->slots[i].handle = (1u << HANDLE_INDEX_BITS) | i;
+	q->slots[i].next = q->free;
+	q->free = q->slots[i].handle;
+    }
+    return 1;
+}
+
+/**
+ * Free the pool of a queue of launched missiles
+ *
+ * @param q queue to free
+ */
+void destroyQueue(struct MissileQueue *q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->ready);
+    pthread_cond_destroy(&q->space);
+    free(q->slots);
+}
+
+/**
+ * Function for attack thread, controls attacker. Launches missiles into a
+ * fixed pool of missile workers, or into the tick engine when configured.
+ * In lockstep, the tick engine launches the missiles itself.
+ *
+ * @param attacker attacker to control
+ * @return NULL
+ */
+void *startAtk(void *attacker) {
+    struct Attacker *nattacker = attacker;
+    game = nattacker->game;
+    countThread("attacker");
+    seedThread(1);
+    int workers = nattacker->workers;
+    if (nattacker->tickEngine) {
+	workers = 1;
+    } else if (workers == 0) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	workers = (n > 0) ? n: 1;
+    }
+
+    struct MissileQueue q;
+    if (!createQueue(&q, nattacker)) {
+	postError("startAtk", strerror(errno));
+    }
+    pthread_mutex_lock(&game->napLock);
+    game->queue = &q;
+    pthread_mutex_unlock(&game->napLock);
+
+    pthread_t tids[workers];
+    int started = 0;
+    void *(*run)(void *) = (nattacker->tickEngine) ? tickEngine:
+	    missileWorker;
+    while (started < workers &&
+		    pthread_create(tids + started, NULL, run, &q) == 0) {
+	started++;
+    }
+    if (started == 0) {
+	postError("startAtk", "unable to start missile workers");
+    }
+
+    struct timespec begin, next;
+    long long launchNs = 0; // game time of next launch, for a rate
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    while (!game->lockstep && !*nattacker->gameOver) {
+	if (nattacker->rate > 0) {
+	    // absolute deadlines catch up after a launch that blocked
+	    launchNs += launchGap(nattacker, launchNs / 1000000);
+	    next = begin;
+	    addTime(&next, launchNs / speedup);
+	} else {
+	    deadline(&next, rngRange(MAX_DELAY_MS * 3));
+	}
+	if (!nap(&next, nattacker->gameOver)) break;
+	int x, speed;
+	aimMissile(nattacker, &x, &speed);
+	if (!launchMissile(&q, x, speed)) break;
+	if (countLaunch(nattacker) || *nattacker->gameOver) endGame();
+    }
+
+    pthread_mutex_lock(&q.lock);
+    q.closed = 1;
+    pthread_cond_broadcast(&q.ready);
+    pthread_mutex_unlock(&q.lock);
+    for (int n = 0; n < started; n++) {
+	pthread_join(tids[n], NULL);
+    }
+    pthread_mutex_lock(&game->napLock);
+    game->queue = NULL;
+    pthread_mutex_unlock(&game->napLock);
+    destroyQueue(&q);
+
+    postEnd(nattacker->name, " attack has ended.");
+    return NULL;
+}
+
+/**
+ * Show the totals of every thread's counters and the frame rate on
+ * message row 1, or clear the row
+ *
+ * @param on 0 to clear the row
+ * @param fps frames per second the terminal is paced to
+ */
+void showStats(_Bool on, long fps) {
+    char line[MSG_LEN] = "";
+    if (on) {
+	struct Counters total;
+	sumCounters(&total);
+	snprintf(line, sizeof line, "launched %llu  blocked %llu  "
+			"city hits %llu  lock waits %llu (%.1f ms)  "
+			"refresh %.0f us  fps %ld", total.launched,
+			total.blocked, total.cityHits, total.lockWaits,
+			total.lockWaitNs / 1e6, (total.refreshes) ?
+			total.refreshNs / 1e3 / total.refreshes: 0.0, fps);
+    }
+    postMessage(1, line);
+}
+
+/**
+ * Write every thread's counters and their totals to a file, one
+ * tab-separated row per thread after a header row
+ *
+ * @param filename file to write
+ * @return 0 if file cannot be written
+ *         1 if successful
+ */
+int dumpStats(const char *filename) {
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) {
+	perror(filename);
+	return 0;
+    }
+    int n = atomic_load(&nthreads);
+    if (n > MAX_THREADS) n = MAX_THREADS;
+    struct Counters total;
+    sumCounters(&total);
+    total.role = "total";
+    fprintf(fp, "thread\trole\tlaunched\tblocked\tcity_hits\tlock_waits\t"
+		    "lock_wait_ns\trefreshes\trefresh_ns\tnet_bytes\n");
+    for (int i = 0; i <= n; i++) {
+	struct Counters *c = (i < n) ? counters + i: &total;
+	if (i < n) fprintf(fp, "%d", i);
+	else fprintf(fp, "-");
+	fprintf(fp, "\t%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+			c->role, (unsigned long long) c->launched,
+			(unsigned long long) c->blocked,
+			(unsigned long long) c->cityHits,
+			(unsigned long long) c->lockWaits,
+			(unsigned long long) c->lockWaitNs,
+			(unsigned long long) c->refreshes,
+			(unsigned long long) c->refreshNs,
+			(unsigned long long) c->netBytes);
+    }
+    int failed = ferror(fp);
+    if (fclose(fp) != 0 || failed) {
+	perror(filename);
+	return 0;
+    }
+    return 1;
+}
+
+/**
+ * Function for render thread. Applies queued shield moves as soon as they
+ * arrive. Once per frame, capped at game->fps and paced to the terminal,
+ * composes the cells that changed and publishes the frame to the output
+ * thread. While the last frame is still unshown, the cells that change
+ * pile up for the next frame instead, so missile positions in between
+ * are merged. Simulation timing never depends on the terminal. Exits
+ * after a final frame once game->renderStop is set.
+ *
+ * @param game game being displayed
+ * @return NULL
+ */
+void *startRender(void *match) {
+    game = match;
+    countThread("render");
+    struct Defender *defender = game->defender;
+    long frameNs = 1000000000L / game->fps;
+    _Bool shown = 0; // stats on screen
+    long rendered = 0; // frames
+    struct timespec next, start, end;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (;;) {
+	_Bool frame = 0;
+	pthread_mutex_lock(&defender->keysLock);
+	// in lockstep the tick engine applies the moves
+	while ((game->lockstep || !keysQueued(defender)) && !frame) {
+	    frame = pthread_cond_timedwait(&defender->keysReady,
+			    &defender->keysLock, &next) == ETIMEDOUT;
+	}
+	pthread_mutex_unlock(&defender->keysLock);
+	for (int s = 0; s < defender->nshields && !game->lockstep; s++) {
+	    int dir[KEY_QUEUE_LEN];
+	    int n = takeKeys(&defender->shields[s].keys, dir);
+	    for (int i = 0; i < n; i++) moveShield(defender, s, dir[i]);
+	}
+	if (!frame) continue;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	_Bool stop = game->renderStop;
+	_Bool overlay = game->overlay;
+	long pace = framePace(frameNs);
+	if (!headless && (overlay != shown || (overlay &&
+				++rendered % (1000000000L / pace) == 0))) {
+	    showStats(overlay, 1000000000L / pace);
+	    shown = overlay;
+	}
+	_Bool behind = atomic_load(&frames.middle) & FRAME_FRESH;
+	if ((!headless || serving) && (!behind || stop)) composeFrame();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	histAdd(&bench.frame, elapsedNs(&start, &end));
+	if (stop) break;
+	addTime(&next, pace);
+    }
+    return NULL;
+}
+
+/**
+ * Function for output thread. Writes each frame the render thread
+ * publishes to the terminal, so a slow terminal only delays this thread.
+ * Exits after showing the last frame once frames.stop is set.
+ *
+ * @param match game being displayed
+ * @return NULL
+ */
+void *startOutput(void *match) {
+    game = match;
+    countThread("output");
+    for (;;) {
+	pthread_mutex_lock(&frames.lock);
+	while (!(atomic_load(&frames.middle) & FRAME_FRESH) && !frames.stop) {
+	    pthread_cond_wait(&frames.ready, &frames.lock);
+	}
+	_Bool stop = frames.stop;
+	pthread_mutex_unlock(&frames.lock);
+	showFrame();
+	if (stop) break;
+    }
+    return NULL;
+}
+
+/**
+ * Read a replay log into memory
+ *
+ * @param filename replay log
+ * @param header set to header of log
+ */
+void loadReplay(const char *filename, struct ReplayHeader *header,
+		struct Replay *replay) {
+    FILE *fp = fopen(filename, "rb");
+    struct stat st;
+    if (fp == NULL || fstat(fileno(fp), &st) == -1) {
+	perror(filename);
+	exit(EXIT_FAILURE);
+    }
+    memset(header, 0, sizeof *header);
+    if (fread(header, sizeof *header, 1, fp) != 1 ||
+		    memcmp(header->magic, REPLAY_MAGIC, 4) != 0 ||
+		    header->width < SHIELD_WIDTH || header->height < 1) {
+	if (memcmp(header->magic, REPLAY_MAGIC, 3) == 0) {
+	    fprintf(stderr, "Error: replay log is from an older version.\n");
+	} else {
+	    fprintf(stderr, "Error: corrupt replay log.\n");
+	}
+	exit(EXIT_FAILURE);
+    }
+    replay->len = st.st_size - sizeof *header;
+    replay->pos = 0;
+    replay->data = malloc(replay->len + 1);
+    if (replay->data == NULL) {
+	perror("loadReplay");
 	exit(EXIT_FAILURE);
     }
-    if (line < 4) {
-	if (line == 0) fprintf(stderr, "Error: missing defender name.\n");
-	else if (line == 1) fprintf(stderr, "Error: missing attacker name.\n");
-	else if (line == 2) fprintf(stderr,
-			"Error: missing missile specification.\n");
-	else fprintf(stderr, "Error: missing city layout.\n");
-	destroyGame(game);
+    if (fread(replay->data, 1, replay->len, fp) != replay->len) {
+	perror(filename);
 	exit(EXIT_FAILURE);
     }
-    return game;
+    fclose(fp);
+}
+
+/**
+ * Print usage and exit
+ */
+void usage(void) {
+    fprintf(stderr, "Usage: threads [--headless [--width cols] "
+		    "[--height rows] [--speedup n] [--duration secs]] "
+		    "[--seed n] [--stats file] [--record log] config-file\n"
+		    "       threads --replay log [--speedup n] [--stats file] "
+		    "config-file\n"
+		    "       threads --pack level-file config-file\n"
+		    "       threads --serve port [--duration secs] [--seed n] "
+		    "[--stats file] [--record log] config-file\n"
+		    "       threads --connect host:port\n"
+		    "       threads --matches n [--shards n] [--width cols] "
+		    "[--height rows] [--duration secs] [--seed n] "
+		    "[--stats file] config-file\n");
+    exit(EXIT_FAILURE);
 }
 
 /**
- * Initialize display for city and defender (shield)
+ * A network client of the server. Its buffer holds messages not yet
+ * sent; a client that falls CLIENT_BACKLOG bytes behind is skipped until
+ * its buffer drains, then sent the whole view.
+ */
+struct Client {
+    int fd;
+    int shield; // index of shield the client moves, -1 to watch
+    unsigned char *out;
+    size_t len; // bytes in out
+    size_t sent; // bytes of out already sent
+    size_t cap;
+    _Bool resync; // skipped frames, needs the whole view
+};
+
+/**
+ * Network server, streams frames to clients and queues their moves.
  *
- * @param game container includes information about city layout
+ * Messages from server to client are a type byte, the payload length as
+ * a LEB128 varint, then the payload. MSG_HELLO, sent once, holds
+ * NET_MAGIC, then varints of the board width, the board height and one
+ * more than the index of the shield the client moves (0 to watch).
+ * MSG_FRAME holds the cells that changed since the previous frame as
+ * runs, each a varint of cells skipped since the previous run, in row
+ * order, a varint of cells in the run and the glyph of each. A client
+ * starts from a blank view and is sent the whole view first.
+ *
+ * Clients send one byte per shield move, EVENT_LEFT or EVENT_RIGHT.
  */
-void initDisplay(struct Game *game) {
-    int prev = 2;
-    for (int i = 0; i < width; i++) {
-	int curr = (i > game->size - 1) ? 2: game->layout[i];
-	if (curr > 2) {
-	    if (curr == prev) {
-		mvinsch(height - curr, i, '_');
-		refresh();
-	    } else if (curr < prev) {
-		if (mvinch(height - prev, i - 1) == '_') {
-		    mvdelch(height - prev, i - 1);
-		    refresh();
-		    for (int j = height - prev + 1; j <= height - 2; j++) {
-		        mvinsch(j, i - 1, '|');
-		        refresh();
-		    }
-		}
-		mvinsch(height - curr, i, '_');
-		refresh();
-	    } else if (curr > prev) {
-		for (int j = height - curr + 1; j <= height - 2; j++) {
-                    mvinsch(j, i, '|');
-                    refresh();
-                }
-	    }
-	} else if (curr == 1 || curr == 2) {
-	    if (prev > 2 && mvinch(height - prev, i - 1) == '_') {
-		mvdelch(height - prev, i - 1);
-		refresh();
-		for (int j = height - prev + 1; j <= height - 2; j++) {
-		    mvinsch(j, i - 1, '|');
-		    refresh();
-		}
+struct Server {
+    struct Game *game; // match being served
+    int listen;
+    struct Client clients[MAX_CLIENTS];
+    int nclients;
+    unsigned char *frame; // payload of last frame message
+    size_t frameLen;
+    unsigned char *view; // payload of the whole view
+    size_t viewLen;
+};
+
+/**
+ * Open a listening TCP socket on a port of every local address
+ *
+ * @param port port number or service name
+ * @return listening socket, non-blocking
+ *         -1 on failure, with error printed
+ */
+int openServer(const char *port) {
+    struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC,
+	    .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    int err = getaddrinfo(NULL, port, &hints, &res);
+    if (err != 0) {
+	fprintf(stderr, "Error: %s: %s.\n", port, gai_strerror(err));
+	return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && fd == -1; ai = ai->ai_next) {
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd == -1) continue;
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 ||
+			listen(fd, MAX_CLIENTS) == -1) {
+	    close(fd);
+	    fd = -1;
+	}
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+	perror(port);
+	return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/**
+ * Encode the runs of cells that differ between two views
+ *
+ * @param cells glyphs of view
+ * @param prev glyphs of previous view, or NULL for the whole view
+ * @param out buffer with room for 4 bytes per cell plus 16
+ * @return bytes written
+ */
+size_t encodeFrame(const char *cells, const char *prev, unsigned char *out) {
+    size_t n = (size_t) HEIGHT * WIDTH;
+    size_t len = 0;
+    size_t last = 0; // end of previous run
+    size_t i = 0;
+    while (i < n) {
+	if (prev && cells[i] == prev[i]) {
+	    i++;
+	    continue;
+	}
+	// a run header costs at least two bytes, so take in short gaps
+	size_t end = i + 1;
+	for (size_t gap = 0; end + gap < n && gap < 3; ) {
+	    if (!prev || cells[end + gap] != prev[end + gap]) {
+		end += gap + 1;
+		gap = 0;
+	    } else {
+		gap++;
 	    }
-	    mvinsch(height - curr, i, '_');
-	    refresh();
 	}
-	prev = curr;
+	len += putVarint(out + len, i - last);
+	len += putVarint(out + len, end - i);
+	memcpy(out + len, cells + i, end - i);
+	len += end - i;
+	last = i = end;
     }
-    game->defender->shieldY = height -
-	    ((game->tallest < 2) ? 2: game->tallest) - 2;
-    game->defender->shieldX = width / 2 - 2; // width >= 4
-    for (size_t i = 0; i < strlen(game->defender->shield); i++) {
-        mvinsch(game->defender->shieldY, game->defender->shieldX, '#');
-	refresh();
+    return len;
+}
+
+/**
+ * Append a message to a client's buffer
+ *
+ * @param client client to send to
+ * @param type MSG_* type
+ * @param payload payload of message
+ * @param n bytes in payload
+ * @return 0 if out of memory
+ *         1 if successful
+ */
+int queueMessage(struct Client *client, int type, const unsigned char *payload,
+		size_t n) {
+    if (client->len + n + 11 > client->cap) {
+	size_t cap = (client->len + n + 11) * 2;
+	unsigned char *out = realloc(client->out, cap);
+	if (out == NULL) return 0;
+	client->out = out;
+	client->cap = cap;
     }
+    client->out[client->len++] = type;
+    client->len += putVarint(client->out + client->len, n);
+    memcpy(client->out + client->len, payload, n);
+    client->len += n;
+    return 1;
 }
 
 /**
- * Display message on curses window
+ * Send as much of a client's buffer as the socket takes without blocking.
+ * Sends the whole view once the buffer of a resyncing client drains.
  *
- * @param str message to display
- * @param r row of curses window to start message
- * @param c col of curses window to start message
- * @param b whether or not to skip a line
- * @return 0 if unable to write message
+ * @param server server of client
+ * @param client client to send to
+ * @return 0 if the connection failed
  *         1 if successful
  */
-int displayMessage(char *str, int *r, int *c, _Bool b) {
-    int oldr = *r;
-    int oldc = *c;
-    if (*r >= height || *r < 0) return 0;
-    while (*c == 0 &&
-		    mvinch(*r, *c) != ' ' && mvinch(*r, *c) != '|') {
-	if (*r == 0 || *r == 1) break;
-	if (++(*r) >= height) {
-	    *r = oldr;
-	    return 0;
+int flushClient(struct Server *server, struct Client *client) {
+    while (client->sent < client->len) {
+	ssize_t n = send(client->fd, client->out + client->sent,
+			client->len - client->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n == -1) {
+	    if (errno == EINTR) continue;
+	    return errno == EAGAIN || errno == EWOULDBLOCK;
 	}
+	client->sent += n;
+	tally(&mine->netBytes, n);
     }
-    if (*r != 0 && *r != 1 && b && *r > 0 && mvinch(*r - 1, 0) != ' ') {
-	if (++(*r) >= height) {
-	    *r = oldr;
+    client->len = client->sent = 0;
+    if (client->resync) {
+	client->resync = 0;
+	if (!queueMessage(client, MSG_FRAME, server->view, server->viewLen)) {
 	    return 0;
 	}
+	return flushClient(server, client);
     }
-    for (size_t i = 0; i < strlen(str); i++) {
-	if (*c / width + *r >= height) {
-	    *r = oldr;
-	    *c = oldc;
-	    return 0;
+    return 1;
+}
+
+/**
+ * Close a client's connection and free its shield
+ *
+ * @param server server of client
+ * @param i index of client
+ */
+void dropClient(struct Server *server, int i) {
+    close(server->clients[i].fd);
+    free(server->clients[i].out);
+    server->clients[i] = server->clients[--server->nclients];
+}
+
+/**
+ * Accept a waiting connection, give it the lowest shield no other client
+ * moves, and send it the hello and the whole view
+ *
+ * @param server server to accept on
+ */
+void acceptClient(struct Server *server) {
+    int fd = accept(server->listen, NULL, NULL);
+    if (fd == -1) return;
+    if (server->nclients == MAX_CLIENTS) {
+	close(fd);
+	return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int shield = -1;
+    for (int s = 0; s < game->defender->nshields && shield == -1; s++) {
+	shield = s;
+	for (int i = 0; i < server->nclients; i++) {
+	    if (server->clients[i].shield == s) shield = -1;
+	}
+    }
+    struct Client *client = server->clients + server->nclients++;
+    *client = (struct Client) { .fd = fd, .shield = shield };
+    unsigned char hello[34];
+    memcpy(hello, NET_MAGIC, 4);
+    size_t n = 4;
+    n += putVarint(hello + n, WIDTH);
+    n += putVarint(hello + n, HEIGHT);
+    n += putVarint(hello + n, shield + 1);
+    if (!queueMessage(client, MSG_HELLO, hello, n) ||
+		    !queueMessage(client, MSG_FRAME, server->view,
+			    server->viewLen) ||
+		    !flushClient(server, client)) {
+	dropClient(server, server->nclients - 1);
+    }
+}
+
+/**
+ * Read a client's shield moves and queue them
+ *
+ * @param client client to read
+ * @return 0 if the connection closed or failed
+ *         1 if successful
+ */
+int readClient(struct Client *client) {
+    unsigned char buf[256];
+    ssize_t n = recv(client->fd, buf, sizeof buf, MSG_DONTWAIT);
+    if (n == -1) return errno == EINTR || errno == EAGAIN ||
+	    errno == EWOULDBLOCK;
+    if (n == 0) return 0;
+    for (ssize_t i = 0; i < n && client->shield >= 0; i++) {
+	if (buf[i] == EVENT_LEFT || buf[i] == EVENT_RIGHT) {
+	    queueKey(game->defender, client->shield,
+			    (buf[i] == EVENT_LEFT) ? -1: 1);
 	}
-	mvdelch(*c / width + *r, *c % width);
-	mvinsch(*c / width + *r, *c % width, str[i]);
-	*c += 1;
-	refresh();
     }
-    *r += *c / width;
     return 1;
 }
 
 /**
- * Function for defense thread, controls defender.
+ * Send a frame to every client: the changes to clients that are up to
+ * date, nothing to those that are behind.
  *
- * @param defender defender to control
+ * @param server server to send from
+ * @param cells glyphs of frame
+ */
+void sendFrame(struct Server *server, const char *cells) {
+    server->frameLen = encodeFrame(cells, frames.shown, server->frame);
+    memcpy(frames.shown, cells, (size_t) HEIGHT * WIDTH);
+    server->viewLen = encodeFrame(cells, NULL, server->view);
+    for (int i = server->nclients - 1; i >= 0; i--) {
+	struct Client *client = server->clients + i;
+	if (!client->resync && client->len - client->sent > CLIENT_BACKLOG) {
+	    client->resync = 1;
+	}
+	if ((!client->resync && !queueMessage(client, MSG_FRAME, server->frame,
+				    server->frameLen)) ||
+			!flushClient(server, client)) {
+	    dropClient(server, i);
+	}
+    }
+}
+
+/**
+ * Function for server thread. Accepts clients, streams them each frame
+ * the render thread publishes as one message of changes, and queues the
+ * moves they send for their shields. Only this thread queues moves for
+ * shields, so clients move shields through the usual queues. Exits once
+ * frames.stop is set, after sending the last frame to every client that
+ * takes it within a second.
+ *
+ * @param server server with listening socket and message buffers
  * @return NULL
  */
-void *startDef(void *defender) {
-    struct Defender *ndefender = defender;
-    _Bool b = 1;
-    flushinp();
-    while (!*ndefender->gameOver || b) {
-	int c = getch();
-	if (c == 'q') {
-	    pthread_mutex_lock(&mutex);
-	    *ndefender->gameOver = 1;
-	    b = 0;
-	    pthread_mutex_unlock(&mutex);
-	} else if (c == KEY_LEFT) {
-	    pthread_mutex_lock(&mutex);
-	    if (ndefender->shieldX > 0) {
-		mvdelch(ndefender->shieldY, ndefender->shieldX + 4);
-		mvinsch(ndefender->shieldY, ndefender->shieldX + 4, ' ');
-                refresh();
-		ndefender->shieldX--;
-		for (int i = 0; i < 5; i++) {
-		    mvdelch(ndefender->shieldY, ndefender->shieldX + i);
-		    mvinsch(ndefender->shieldY, ndefender->shieldX + i, '#');
-		    refresh();
-		}
+void *startServer(void *server) {
+    struct Server *nserver = server;
+    game = nserver->game;
+    countThread("server");
+    nserver->viewLen = encodeFrame(frames.shown, NULL, nserver->view);
+
+    struct pollfd fds[2 + MAX_CLIENTS];
+    struct timespec deadline;
+    _Bool stop = 0;
+    for (;;) {
+	int nfds = 0;
+	if (!stop) {
+	    fds[nfds++] = (struct pollfd) { .fd = nserver->listen,
+		    .events = POLLIN };
+	    fds[nfds++] = (struct pollfd) { .fd = frames.notify[0],
+		    .events = POLLIN };
+	}
+	_Bool pending = 0;
+	for (int i = 0; i < nserver->nclients; i++) {
+	    struct Client *client = nserver->clients + i;
+	    fds[nfds + i] = (struct pollfd) { .fd = client->fd,
+		    .events = ((stop) ? 0: POLLIN) |
+			    ((client->len > client->sent) ? POLLOUT: 0) };
+	    if (client->len > client->sent) pending = 1;
+	}
+	if (stop && !pending) break;
+	int timeout = -1;
+	if (stop) {
+	    struct timespec now;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    if (timeCmp(&now, &deadline) >= 0) break;
+	    timeout = elapsedNs(&now, &deadline) / 1000000 + 1;
+	}
+	if (poll(fds, nfds + nserver->nclients, timeout) == -1) {
+	    if (errno == EINTR) continue;
+	    break;
+	}
+	// walk clients from the end, as dropping one moves the last into it
+	for (int i = nserver->nclients - 1; i >= 0; i--) {
+	    short revents = fds[nfds + i].revents;
+	    struct Client *client = nserver->clients + i;
+	    if (((revents & POLLIN) && !readClient(client)) ||
+			    ((revents & POLLOUT) &&
+			     !flushClient(nserver, client)) ||
+			    (revents & (POLLERR | POLLNVAL))) {
+		dropClient(nserver, i);
 	    }
-	    pthread_mutex_unlock(&mutex);
-	} else if (c == KEY_RIGHT) {
-	    pthread_mutex_lock(&mutex);
-	    if (ndefender->shieldX < width - 5) {
-		mvdelch(ndefender->shieldY, ndefender->shieldX);
-		mvinsch(ndefender->shieldY, ndefender->shieldX, ' ');
-                refresh();
-		ndefender->shieldX++;
-		for (int i = 0; i < 5; i++) {
-		    mvdelch(ndefender->shieldY, ndefender->shieldX + i);
-		    mvinsch(ndefender->shieldY, ndefender->shieldX + i, '#');
-		    refresh();
-		}
+	}
+	if (stop) continue;
+	if (fds[0].revents & POLLIN) acceptClient(nserver);
+	if (fds[1].revents & POLLIN) {
+	    char buf[64];
+	    while (read(frames.notify[0], buf, sizeof buf) > 0);
+	    pthread_mutex_lock(&frames.lock);
+	    stop = frames.stop;
+	    pthread_mutex_unlock(&frames.lock);
+	    const char *frame = takeFrame();
+	    if (frame) sendFrame(nserver, frame);
+	    if (stop) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		addTime(&deadline, 1000000000L);
 	    }
-	    pthread_mutex_unlock(&mutex);
 	}
     }
-    pthread_mutex_lock(&mutex);
-    if (!displayMessage("The ", &row, &col, 1)) {
-	int row_temp = 1;
-	displayMessage("The ", &row_temp, &col, 0);
-	if (row_temp > row) row = row_temp;
+    while (nserver->nclients > 0) dropClient(nserver, 0);
+    free(nserver->frame);
+    free(nserver->view);
+    return NULL;
+}
+
+/**
+ * Draw the runs of a frame message on the curses window, clipped to it
+ *
+ * @param p payload of message
+ * @param len bytes in payload
+ * @param cols board width of server
+ * @return 0 if message is malformed
+ *         1 if successful
+ */
+int drawRuns(const unsigned char *p, size_t len, int cols) {
+    size_t pos = 0;
+    uint64_t cell = 0;
+    while (pos < len) {
+	uint64_t skip, n;
+	if (!getVarint(p, len, &pos, &skip) || !getVarint(p, len, &pos, &n) ||
+			n > len - pos) {
+	    return 0;
+	}
+	cell += skip;
+	for (uint64_t i = 0; i < n; i++, cell++) {
+	    int y = cell / cols;
+	    int x = cell % cols;
+	    if (y < LINES && x < COLS) mvaddch(y, x, p[pos + i]);
+	}
+	pos += n;
+    }
+    return 1;
+}
+
+/**
+ * Connect to a server and show its frames on the terminal until it
+ * closes the connection or the user quits. The arrow keys move the
+ * shield the server gave this client.
+ *
+ * @param addr host:port of server
+ * @return 0 if unable to connect or the server misbehaved
+ *         1 if successful
+ */
+int runClient(char *addr) {
+    char *colon = strrchr(addr, ':');
+    if (colon == NULL) usage();
+    *colon = '\0';
+    struct addrinfo hints = { .ai_family = AF_UNSPEC,
+	    .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    int err = getaddrinfo(addr, colon + 1, &hints, &res);
+    if (err != 0) {
+	fprintf(stderr, "Error: %s: %s.\n", addr, gai_strerror(err));
+	return 0;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && fd == -1; ai = ai->ai_next) {
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+	    close(fd);
+	    fd = -1;
+	}
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+	perror(addr);
+	return 0;
+    }
+
+    if (!watchSignals()) {
+	perror("signalfd");
+	close(fd);
+	return 0;
     }
-    if (!displayMessage(ndefender->name, &row, &col, 0)) {
-	int row_temp = 1;
-	displayMessage(ndefender->name, &row_temp, &col, 0);
-	if (row_temp > row) row = row_temp;
+    initscr();
+    atexit(restoreTerminal);
+    cbreak();
+    noecho();
+    keypad(stdscr, 1);
+    nodelay(stdscr, 1);
+    size_t cap = 65536, len = 0;
+    size_t most = cap; // longest legal message, known once hello arrives
+    unsigned char *in = malloc(cap);
+    int cols = 0; // 0 until hello
+    int shield = 0;
+    _Bool ok = (in != NULL), open = 1;
+    struct pollfd fds[3] = {
+	{ .fd = STDIN_FILENO, .events = POLLIN },
+	{ .fd = fd, .events = POLLIN },
+	{ .fd = signals, .events = POLLIN }
+    };
+    while (ok && open) {
+	if (poll(fds, 3, -1) == -1) {
+	    if (errno == EINTR) continue;
+	    break;
+	}
+	if (fds[2].revents) {
+	    open = 0; // closes like a quit
+	    break;
+	}
+	int c;
+	while ((c = getch()) != ERR) {
+	    unsigned char move = (c == KEY_LEFT) ? EVENT_LEFT: EVENT_RIGHT;
+	    if (c == 'q') open = 0;
+	    else if ((c == KEY_LEFT || c == KEY_RIGHT) && shield > 0) {
+		send(fd, &move, 1, MSG_NOSIGNAL);
+	    }
+	}
+	if (!(fds[1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+	if (len == cap) {
+	    if (cap >= most) {
+		ok = 0; // no legal message is this long
+		break;
+	    }
+	    size_t grown = (cap * 2 < most) ? cap * 2: most;
+	    unsigned char *bigger = realloc(in, grown);
+	    if (bigger == NULL) break;
+	    in = bigger;
+	    cap = grown;
+	}
+	ssize_t n = recv(fd, in + len, cap - len, 0);
+	if (n <= 0) {
+	    if (n == -1 && errno == EINTR) continue;
+	    break;
+	}
+	len += n;
+	size_t pos = 0;
+	for (;;) {
+	    size_t start = pos + 1;
+	    uint64_t size;
+	    if (pos >= len || !getVarint(in, len, &start, &size)) break;
+	    if (size > most - (start - pos)) {
+		ok = 0;
+		break;
+	    }
+	    if (size > len - start) break;
+	    const unsigned char *p = in + start;
+	    if (in[pos] == MSG_HELLO) {
+		size_t at = 4;
+		uint64_t w, h, s;
+		ok = size >= 4 && memcmp(p, NET_MAGIC, 4) == 0 &&
+			getVarint(p, size, &at, &w) &&
+			getVarint(p, size, &at, &h) &&
+			getVarint(p, size, &at, &s) && w > 0 &&
+			w <= UINT16_MAX && h > 0 && h <= UINT16_MAX;
+		if (ok) {
+		    cols = w;
+		    shield = s;
+		    // a frame is at most 4 bytes per cell, as the server
+		    // allocates, after its type byte and length
+		    most = 11 + w * h * 4 + 16;
+		    if (most < cap) most = cap;
+		}
+	    } else if (in[pos] == MSG_FRAME) {
+		ok = cols > 0 && drawRuns(p, size, cols);
+	    }
+	    if (!ok) break;
+	    pos = start + size;
+	}
+	memmove(in, in + pos, len - pos);
+	len -= pos;
+	refresh();
     }
-    if (!displayMessage(" defense has ended.", &row, &col, 0)) {
-	int row_temp = 1;
-	displayMessage(" defense has ended.", &row_temp, &col, 0);
-	if (row_temp > row) row = row_temp;
+    close(fd);
+    free(in);
+    if (open) {
+	mvaddstr(1, 0, (ok) ? "connection closed, hit enter to close...":
+			"bad message from server, hit enter to close...");
+	clrtoeol();
+	refresh();
+	waitForEnter();
     }
-    col = 0;
-    pthread_mutex_unlock(&mutex);
-    return NULL;
+    endwin();
+    if (!ok) fprintf(stderr, "Error: bad message from server.\n");
+    return ok;
+}
+
+/**
+ * Set the size of the board. A fixed build only runs on its own board
+ * size, and draws in the top left corner of a larger terminal.
+ *
+ * @param rows rows of board
+ * @param cols cols of board
+ * @param atLeast whether a larger board may be cut down to the fixed size
+ * @return 0 if the build cannot run on a board of that size
+ *         1 if successful
+ */
+int setBoardSize(int rows, int cols, _Bool atLeast) {
+#ifdef BOARD_WIDTH
+    if (atLeast) return rows >= HEIGHT && cols >= WIDTH;
+    return rows == HEIGHT && cols == WIDTH;
+#else
+    (void) atLeast;
+    game->height = rows;
+    game->width = cols;
+    return 1;
+#endif
+}
+
+/**
+ * One match of a battle server, see --matches. A match is headless and in
+ * lockstep, so it has no threads of its own: a shard runs its engine a
+ * tick at a time, with the bot's moves drawn from a stream of its own.
+ */
+struct Match {
+    struct Game *game;
+    struct MissileQueue queue;
+    struct Engine engine;
+    struct Rng launches; // random stream of the engine
+    struct Rng moves; // random stream of the bot
+    size_t bytes; // memory held by the match
+    _Bool over;
+};
+
+/**
+ * Shard of a battle server: runs matches first, first + stride, ... in
+ * turn, one tick each, until all of them are over
+ */
+struct Shard {
+    struct Match *matches;
+    int nmatches;
+    int first;
+    int stride;
+};
+
+/**
+ * Get the memory a match holds once its engine is started: the game, its
+ * city, collision grid, missile pool and the engine's swarm and crew. A
+ * match that is not drawn has no frames, message text or dirty rows.
+ *
+ * @param m match to measure
+ * @return bytes allocated for the match
+ */
+size_t matchBytes(const struct Match *m) {
+    const struct Game *game = m->game;
+    size_t limit = m->queue.limit;
+    size_t nblocks = m->engine.crew.nblocks;
+    size_t bytes = sizeof *m + sizeof *game + sizeof *game->defender +
+	    sizeof *game->attacker;
+    bytes += sizeof *game->layout * game->cap + LAYOUT_PAD;
+    if (game->settings) bytes += strlen(game->settings) + 1;
+    if (game->defender->name) bytes += strlen(game->defender->name) + 1;
+    if (game->attacker->name) bytes += strlen(game->attacker->name) + 1;
+    bytes += (size_t) HEIGHT * WORLD_WIDTH * (1 + sizeof *game->sky) +
+	    sizeof *game->cover * WORLD_WIDTH +
+	    sizeof *game->shielded * ROW_WORDS * (1 + (size_t) HEIGHT) +
+	    sizeof *game->skyline * 2 * game->skylineLeaves;
+    bytes += sizeof *m->queue.slots * limit;
+    bytes += limit * (sizeof *m->engine.swarm.x * 5 +
+		    sizeof *m->engine.swarm.handle + sizeof *m->engine.landed +
+		    sizeof *m->engine.crew.order);
+    bytes += sizeof *m->engine.crew.razed * WORLD_WIDTH +
+	    sizeof *m->engine.crew.count * nblocks +
+	    sizeof *m->engine.crew.first * (nblocks + 1) +
+	    sizeof *m->engine.crew.deques + sizeof *m->engine.crew.rings *
+	    nblocks + sizeof *m->engine.crew.helpers;
+    return bytes;
 }
 
 /**
- * Function for a missile thread, controls a missile.
+ * Function for a shard thread of a battle server. Starts the engine of
+ * each of its matches, then runs one tick of every match in turn. Every
+ * 20 ms of game time the bot moves each shield at random, and a match
+ * ends after its duration in game time.
  *
- * @param missile missile to control
+ * @param shard matches to run
  * @return NULL
  */
-void *launchMissile(void *missile) {
-    struct Missile *nmissile = missile;
-    pthread_mutex_lock(&mutex);
-    char prevc = (mvinch(nmissile->y, nmissile->x) == '|') ?
-	    ' ': mvinch(nmissile->y, nmissile->x);
-    mvdelch(nmissile->y, nmissile->x);
-    mvinsch(nmissile->y, nmissile->x, nmissile->c);
-    pthread_mutex_unlock(&mutex);
-    while (nmissile->c != '*') {
-        usleep(rand() % MAX_DELAY_MS * 1000);
-        pthread_mutex_lock(&mutex);
-        if (nmissile->y < height) mvdelch(nmissile->y, nmissile->x);
-        if (nmissile->y < height) mvinsch(nmissile->y, nmissile->x, prevc);
-	refresh();
-	nmissile->y++;
-	char c = (nmissile->y >= height) ?
-		' ': mvinch(nmissile->y, nmissile->x);
-        if (c == '#' ||
-		(c == '*' && nmissile->y < height - game->tallest)) {
-	    nmissile->c = '*';
-	} else if (nmissile->y == height - ((nmissile->x > game->size - 1) ?
-				2: game->layout[nmissile->x]) + 1) {
-            nmissile->c = '*';
-	    if (nmissile->x < game->size &&
-			    game->layout[nmissile->x] != 2) {
-		game->layout[nmissile->x]--;
+void *startShard(void *shard) {
+    struct Shard *nshard = shard;
+    countThread("shard");
+    int running = 0;
+    for (int i = nshard->first; i < nshard->nmatches; i += nshard->stride) {
+	struct Match *m = nshard->matches + i;
+	game = m->game;
+	if (!createQueue(&m->queue, game->attacker)) endGame();
+	startEngine(&m->engine, &m->queue, 1);
+	m->launches = rng;
+	seedThread(2);
+	m->moves = rng;
+	m->bytes = matchBytes(m);
+	running++;
+    }
+    while (running > 0) {
+	for (int i = nshard->first; i < nshard->nmatches;
+			i += nshard->stride) {
+	    struct Match *m = nshard->matches + i;
+	    if (m->over) continue;
+	    game = m->game;
+	    struct Engine *e = &m->engine;
+	    struct Defender *defender = game->defender;
+	    long moveTicks = (20 > e->tickMs) ? 20 / e->tickMs: 1;
+	    if (e->tick % moveTicks == 0) {
+		rng = m->moves;
+		for (int s = 0; s < defender->nshields; s++) {
+		    int dir = rngRange(3) - 1;
+		    if (dir != 0) queueKey(defender, s, dir);
+		}
+		m->moves = rng;
+	    }
+	    if (defender->duration > 0 && !game->gameOver &&
+			    (long long) e->tick * e->tickMs >=
+			    defender->duration * 1000LL) {
+		endGame();
 	    }
-        } else if (c == '|' ||
-		c == '_' ||
-		c == '?' ||
-	        c == '*') {
-            prevc = ' ';
-        } else {
-            prevc = c;
-        }
-        if (nmissile->y < height) {
-	    mvdelch(nmissile->y, nmissile->x);
-	}
-        if (nmissile->y < height) {
-	    mvinsch(nmissile->y, nmissile->x, nmissile->c);
-	}
-	if (nmissile->c == '*' && nmissile->y <= height) {
-	    mvdelch(nmissile->y - 1, nmissile->x);
-	    mvinsch(nmissile->y - 1, nmissile->x, '?');
-	}
-        refresh();
-        pthread_mutex_unlock(&mutex);
-	if (nmissile->y > height) break;
+	    rng = m->launches;
+	    if (!engineTick(e)) {
+		stopEngine(e);
+		destroyQueue(&m->queue);
+		m->over = 1;
+		running--;
+	    }
+	    m->launches = rng;
+	}
     }
     return NULL;
 }
 
 /**
- * Function for attack thread, controls attacker.
+ * Free the games of a battle server's matches
  *
- * @param attacker attacker to control
- * @return NULL
+ * @param matches matches to free
+ * @param n number of matches
  */
-void *startAtk(void *attacker) {
-    struct Attacker *nattacker = attacker;
-    int packetSize = (width > 32) ? 8: ((width / 4 == 0) ? width: width / 4);
-    struct Missile *missiles = calloc(packetSize, sizeof *missiles);
-    if (missiles == NULL) {
-	int row_tmp = 1;
-	pthread_mutex_lock(&mutex);
-        displayMessage("startAtk: ", &row_tmp, &col, 0);
-	displayMessage(strerror(errno), &row_tmp, &col, 0);
-	if (row_tmp > row) row = row_tmp;
-	col = 0;
-	*nattacker->gameOver = 1;
-	pthread_mutex_unlock(&mutex);
-    }
-    pthread_t tids[packetSize];
-    while (!*nattacker->gameOver) {
-	int i = 0;
-	while (i < packetSize) {
-	    usleep(rand() % (MAX_DELAY_MS * 3) * 1000);
-	    missiles[i].y = 2;
-	    missiles[i].x = rand() % width;
-	    missiles[i].c = '|';
-
-	    pthread_create(tids + i, NULL, launchMissile, missiles + i);
-	    i++;
-	    if (*nattacker->gameOver ||
-		    ((nattacker->totalMissiles > 0) ?
-		     (--nattacker->totalMissiles == 0): 0)) {
-		pthread_mutex_lock(&mutex);
-		*nattacker->gameOver = 1;
-		pthread_mutex_unlock(&mutex);
-		break;
-	    }
+void destroyMatches(struct Match *matches, int n) {
+    for (int i = 0; i < n; i++) destroyGame(matches[i].game);
+    free(matches);
+}
+
+/**
+ * Run a battle server: n headless matches of one config, match i with
+ * seed + i, sharded over nshards threads, then print their totals and the
+ * memory each match held
+ *
+ * @param filename config file of every match
+ * @param n number of matches
+ * @param nshards number of shard threads, 0 for one per processor
+ * @param seed seed of match 0
+ * @param rows rows of every board
+ * @param cols cols of every board
+ * @param duration seconds of game time each match lasts, 0 to run out
+ * @param stats file to dump counters to, or NULL
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int runMatches(char *filename, int n, int nshards, uint64_t seed, int rows,
+		int cols, int duration, const char *stats) {
+#ifdef BOARD_WIDTH
+    if (n > 1) {
+	fprintf(stderr, "Error: this build runs one match at a time.\n");
+	exit(EXIT_FAILURE);
+    }
+#endif
+    headless = 1;
+    struct Match *matches = calloc(n, sizeof *matches);
+    if (matches == NULL) {
+	perror("runMatches");
+	exit(EXIT_FAILURE);
+    }
+    unsigned long long loadNs = 0;
+    for (int i = 0; i < n; i++) {
+	struct timespec loadStart, loadEnd;
+	clock_gettime(CLOCK_MONOTONIC, &loadStart);
+	game = createGame(filename);
+	clock_gettime(CLOCK_MONOTONIC, &loadEnd);
+	loadNs += elapsedNs(&loadStart, &loadEnd);
+	matches[i].game = game;
+	if (game->stream) {
+	    fprintf(stderr, "Error: matches cannot have endless cities.\n");
+	    destroyMatches(matches, i + 1);
+	    exit(EXIT_FAILURE);
 	}
-	for (int n = 0; n < i; n++) {
-	    pthread_join(tids[n], NULL);
+	game->seed = seed + i;
+	game->lockstep = 1;
+	game->fastForward = 1;
+	game->attacker->tickEngine = 1;
+	game->defender->duration = duration;
+	if (!setBoardSize(rows, cols, 0)) {
+	    fprintf(stderr, "Error: this build only runs on a %dx%d board.\n",
+			    WIDTH, HEIGHT);
+	    destroyMatches(matches, i + 1);
+	    exit(EXIT_FAILURE);
 	}
+#ifdef BOARD_WIDTH
+	if (game->size > BOARD_WORLD) {
+	    fprintf(stderr, "Error: city is wider than the %d columns of "
+			    "this build.\n", BOARD_WORLD);
+	    destroyMatches(matches, i + 1);
+	    exit(EXIT_FAILURE);
+	}
+#endif
+	if (HEIGHT - ((game->tallest < 2) ? 2: game->tallest) - 2 - 1 - 2 < 0) {
+	    fprintf(stderr, "Error: board height (%d) shorter than layout.\n",
+			    HEIGHT);
+	    destroyMatches(matches, i + 1);
+	    exit(EXIT_FAILURE);
+	}
+	if (!createGrid(game, 0)) {
+	    perror("createGrid");
+	    destroyMatches(matches, i + 1);
+	    exit(EXIT_FAILURE);
+	}
+	initDisplay(game);
     }
-    pthread_mutex_lock(&mutex);
-    if (!displayMessage("The ", &row, &col, 1)) {
-        int row_temp = 1;
-        displayMessage("The ", &row_temp, &col, 0);
-        if (row_temp > row) row = row_temp;
+    if (nshards == 0) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nshards = (cpus > 0) ? cpus: 1;
     }
-    if (!displayMessage(nattacker->name, &row, &col, 0)) {
-        int row_temp = 1;
-        displayMessage(nattacker->name, &row_temp, &col, 0);
-        if (row_temp > row) row = row_temp;
+    if (nshards > n) nshards = n;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct Shard shards[nshards];
+    pthread_t tids[nshards];
+    int started = 0;
+    for (int i = 0; i < nshards; i++) {
+	shards[i] = (struct Shard) { .matches = matches, .nmatches = n,
+		.first = i, .stride = nshards };
+	if (started == i && pthread_create(tids + i, NULL, startShard,
+				shards + i) == 0) {
+	    started++;
+	}
     }
-    if (!displayMessage(" attack has ended.", &row, &col, 0)) {
-        int row_temp = 1;
-        displayMessage(" attack has ended.", &row_temp, &col, 0);
-        if (row_temp > row) row = row_temp;
+    // this thread runs the shards that could not be started
+    for (int i = started; i < nshards; i++) startShard(shards + i);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = elapsedNs(&start, &end) / 1e9;
+    unsigned long long ticks = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+	ticks += matches[i].engine.tick;
+	bytes += matches[i].bytes;
     }
-    col = 0;
-    pthread_mutex_unlock(&mutex);
-    free(missiles);
-    return NULL;
+    printf("seed: %llu\n", (unsigned long long) seed);
+    printf("matches: %d on %d shards, %llu ticks in %.2f s (%.0f/s)\n", n,
+		    nshards, ticks, secs, ticks / secs);
+    printf("memory: %zu bytes per match, peak rss %ld KB\n", bytes / n,
+		    peakRss());
+    printf("load time: %.3f ms per match\n", loadNs / 1e6 / n);
+    struct Counters total;
+    sumCounters(&total);
+    printf("missiles: %llu launched, %llu landed (%.1f/s)\n",
+		    (unsigned long long) total.launched, bench.landed,
+		    bench.landed / secs);
+    printf("hits: %llu on shield, %llu on city\n",
+		    (unsigned long long) total.blocked,
+		    (unsigned long long) total.cityHits);
+    histPrint("lock hold", &bench.lockHold);
+    histPrint("shield move", &bench.shield);
+    histPrint("tick time", &bench.tick);
+    if (bench.kernel) printf("step kernel: %s\n", bench.kernel);
+    int retval = !stats || dumpStats(stats);
+    destroyMatches(matches, n);
+    return (retval) ? EXIT_SUCCESS: EXIT_FAILURE;
 }
 
 /**
@@ -536,52 +5011,307 @@ void *startAtk(void *attacker) {
  * @return 0 on successful execution
  */
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: threads config-file\n");
-        exit(EXIT_FAILURE);
+    static struct option options[] = {
+	{"headless", no_argument, NULL, 'H'},
+	{"width", required_argument, NULL, 'w'},
+	{"height", required_argument, NULL, 'h'},
+	{"speedup", required_argument, NULL, 's'},
+	{"duration", required_argument, NULL, 'd'},
+	{"seed", required_argument, NULL, 'S'},
+	{"pack", required_argument, NULL, 'p'},
+	{"stats", required_argument, NULL, 'D'},
+	{"record", required_argument, NULL, 'r'},
+	{"replay", required_argument, NULL, 'R'},
+	{"serve", required_argument, NULL, 'N'},
+	{"connect", required_argument, NULL, 'C'},
+	{"matches", required_argument, NULL, 'M'},
+	{"shards", required_argument, NULL, 'K'},
+	{NULL, 0, NULL, 0}
+    };
+    int opt, duration = 0, rows = DEFAULT_HEIGHT, cols = DEFAULT_WIDTH;
+    int matches = 0, shards = 0;
+    char *pack = NULL;
+    char *stats = NULL;
+    char *record = NULL;
+    char *replayLog = NULL;
+    char *port = NULL;
+    char *server = NULL;
+    struct ReplayHeader header;
+    struct Replay replay = { .data = NULL };
+    uint64_t seed = time(NULL);
+    speedup = 0;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+	if (opt == 'H') headless = 1;
+	else if (opt == 'w') {
+	    if (!strInt(optarg, &cols) || cols < SHIELD_WIDTH) usage();
+	} else if (opt == 'h') {
+	    if (!strInt(optarg, &rows) || rows < 1) usage();
+	} else if (opt == 's') {
+	    if (!strInt(optarg, &speedup) || speedup < 1) usage();
+	} else if (opt == 'd') {
+	    if (!strInt(optarg, &duration) || duration < 0) usage();
+	} else if (opt == 'S') {
+	    char *end;
+	    errno = 0;
+	    seed = strtoull(optarg, &end, 10);
+	    if (errno != 0 || *optarg == '\0' || *end != '\0') usage();
+	} else if (opt == 'p') pack = optarg;
+	else if (opt == 'D') stats = optarg;
+	else if (opt == 'r') record = optarg;
+	else if (opt == 'R') replayLog = optarg;
+	else if (opt == 'N') port = optarg;
+	else if (opt == 'C') server = optarg;
+	else if (opt == 'M') {
+	    if (!strInt(optarg, &matches) || matches < 1) usage();
+	} else if (opt == 'K') {
+	    if (!strInt(optarg, &shards) || shards < 1) usage();
+	} else usage();
+    }
+    if (server) {
+	if (optind != argc || argc != 3) usage();
+	return (runClient(server)) ? EXIT_SUCCESS: EXIT_FAILURE;
+    }
+    if (optind != argc - 1) usage();
+    if (record && replayLog) usage();
+    if (shards && !matches) usage();
+    if (matches) {
+	if (record || replayLog || pack || port) usage();
+	return runMatches(argv[optind], matches, shards, seed, rows, cols,
+			duration, stats);
+    }
+    countThread("main");
+    if (replayLog) {
+	loadReplay(replayLog, &header, &replay);
+	headless = 1;
+	cols = header.width;
+	rows = header.height;
+	seed = header.seed;
+    }
+    struct timespec loadStart, loadEnd;
+    clock_gettime(CLOCK_MONOTONIC, &loadStart);
+    game = createGame(argv[optind]);
+    clock_gettime(CLOCK_MONOTONIC, &loadEnd);
+    game->seed = seed;
+    game->replay = replay;
+    game->fastForward = replayLog && speedup == 0;
+    if (port) headless = serving = 1;
+    if (speedup == 0) speedup = (headless && !serving) ? 100: 1;
+    if (headless && !setBoardSize(rows, cols, 0)) {
+	fprintf(stderr, "Error: this build only runs on a %dx%d board.\n",
+			WIDTH, HEIGHT);
+	destroyGame(game);
+	exit(EXIT_FAILURE);
+    }
+    if (pack) {
+	int retval = writeLevel(game, pack);
+	destroyGame(game);
+	return (retval) ? EXIT_SUCCESS: EXIT_FAILURE;
+    }
+#ifdef BOARD_WIDTH
+    if (game->size > BOARD_WORLD) {
+	fprintf(stderr, "Error: city is wider than the %d columns of this "
+			"build.\n", BOARD_WORLD);
+	destroyGame(game);
+	exit(EXIT_FAILURE);
+    }
+#endif
+    game->defender->duration = duration;
+    uint32_t hash = configHash(game);
+    if (replayLog && hash != header.configHash) {
+	fprintf(stderr, "Error: replay was recorded with another config.\n");
+	destroyGame(game);
+	exit(EXIT_FAILURE);
+    }
+    if (record || replayLog) {
+	game->lockstep = 1;
+	game->attacker->tickEngine = 1;
+    }
+    if (!watchSignals() || pipe(signalWake) == -1) {
+	perror("signalfd");
+	destroyGame(game);
+	exit(EXIT_FAILURE);
     }
-    game = createGame(argv[1]);
 
-    initscr();
-    cbreak();
-    noecho();
-    keypad(stdscr, 1);
-    getmaxyx(stdscr, height, width);
+    if (!headless) {
+	initscr();
+	atexit(restoreTerminal);
+	cbreak();
+	noecho();
+	keypad(stdscr, 1);
+	getmaxyx(stdscr, rows, cols);
+	if (!setBoardSize(rows, cols, 1)) {
+	    endwin();
+	    fprintf(stderr, "Error: terminal is smaller than the %dx%d board "
+			    "of this build.\n", WIDTH, HEIGHT);
+	    destroyGame(game);
+	    exit(EXIT_FAILURE);
+	}
+	// read keys from a pad so getting input never refreshes stdscr
+	game->defender->input = newpad(1, 1);
+	if (game->defender->input == NULL) {
+	    endwin();
+	    fprintf(stderr, "Error: unable to create input pad.\n");
+	    destroyGame(game);
+	    exit(EXIT_FAILURE);
+	}
+	keypad(game->defender->input, 1);
+	if (pipe(game->defender->wake) == -1) {
+	    endwin();
+	    perror("pipe");
+	    destroyGame(game);
+	    exit(EXIT_FAILURE);
+	}
+    }
 
-    if (height - ((game->tallest < 2) ? 2: game->tallest) - 2 - 1 - 2 < 0) {
-	endwin();
+    if (HEIGHT - ((game->tallest < 2) ? 2: game->tallest) - 2 - 1 - 2 < 0) {
+	if (!headless) endwin();
 	fprintf(stderr,
 		"Error: runtime terminal height (%d) shorter than layout.\n",
-		height);
+		HEIGHT);
+	destroyGame(game);
+	exit(EXIT_FAILURE);
+    }
+
+    _Bool drawn = !headless || serving;
+    if (!createGrid(game, drawn) || (drawn && !createFrames())) {
+	if (!headless) endwin();
+	perror("createGrid");
 	destroyGame(game);
 	exit(EXIT_FAILURE);
     }
+    struct Server net = { .game = game, .listen = -1 };
+    if (serving) {
+	if (pipe(frames.notify) == -1) {
+	    perror("pipe");
+	    destroyGame(game);
+	    exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 2; i++) {
+	    fcntl(frames.notify[i], F_SETFL,
+			    fcntl(frames.notify[i], F_GETFL) | O_NONBLOCK);
+	}
+	net.listen = openServer(port);
+	if (net.listen == -1) {
+	    destroyFrames();
+	    destroyGame(game);
+	    exit(EXIT_FAILURE);
+	}
+	// a frame message is at most 4 bytes of runs and glyph per cell
+	size_t cells = (size_t) HEIGHT * WIDTH;
+	net.frame = malloc(cells * 4 + 16);
+	net.view = malloc(cells * 4 + 16);
+	if (net.frame == NULL || net.view == NULL) {
+	    perror("startServer");
+	    close(net.listen);
+	    destroyFrames();
+	    destroyGame(game);
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    if (record) {
+	game->recordFile = fopen(record, "wb");
+	if (game->recordFile == NULL) {
+	    if (!headless) endwin();
+	    perror(record);
+	    destroyGame(game);
+	    exit(EXIT_FAILURE);
+	}
+	struct ReplayHeader out = { .configHash = hash, .seed = seed,
+		.width = WIDTH, .height = HEIGHT };
+	memcpy(out.magic, REPLAY_MAGIC, sizeof out.magic);
+	fwrite(&out, sizeof out, 1, game->recordFile);
+	// deltas start from tick 0 and shield 0, as replayEvent reads them
+	game->recordTick = 0;
+	game->recordShield = 0;
+    }
 
-    srand(time(NULL));
     initDisplay(game);
-    pthread_mutex_lock(&mutex);
-    int row_temp = 0;
-    displayMessage("Enter 'q' to quit at end of attack, or control-C",
-		    &row_temp, &col, 0);
-    col = 0;
-    pthread_mutex_unlock(&mutex);
-
-    pthread_t defTID, atkTID;
-    pthread_create(&defTID, NULL, startDef, game->defender);
+    if (!startStream(game)) {
+	if (!headless) endwin();
+	perror("startStream");
+	destroyGame(game);
+	exit(EXIT_FAILURE);
+    }
+    postMessage(0, "Enter 'q' to quit, or control-C");
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t defTID, atkTID, renderTID, outputTID, sigTID;
+    pthread_create(&sigTID, NULL, startSignals, game);
+    if (!headless) pthread_create(&outputTID, NULL, startOutput, game);
+    else if (serving) pthread_create(&outputTID, NULL, startServer, &net);
+    pthread_create(&renderTID, NULL, startRender, game);
+    if (!replayLog) {
+	pthread_create(&defTID, NULL, (headless) ? startBot: startDef,
+			game->defender);
+    }
     pthread_create(&atkTID, NULL, startAtk, game->attacker);
-    pthread_join(defTID, NULL);
+    if (!replayLog) pthread_join(defTID, NULL);
     pthread_join(atkTID, NULL);
+    while (write(signalWake[1], "", 1) == -1 && errno == EINTR);
+    pthread_join(sigTID, NULL);
+    close(signalWake[0]);
+    close(signalWake[1]);
+    game->renderStop = 1;
+    pthread_join(renderTID, NULL);
+    stopStream(game);
+    if (!headless || serving) {
+	pthread_mutex_lock(&frames.lock);
+	frames.stop = 1;
+	pthread_cond_signal(&frames.ready);
+	pthread_mutex_unlock(&frames.lock);
+	if (serving) {
+	    while (write(frames.notify[1], "", 1) == -1 && errno == EINTR);
+	}
+	pthread_join(outputTID, NULL);
+    }
+    if (net.listen != -1) close(net.listen);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    int retval = 1;
+    if (game->recordFile) {
+	int failed = ferror(game->recordFile);
+	if (fclose(game->recordFile) != 0 || failed) {
+	    perror(record);
+	    retval = 0;
+	}
+    }
+    free(game->replay.data);
+
+    if (headless) {
+	double secs = elapsedNs(&start, &end) / 1e9;
+	printf("seed: %llu\n", (unsigned long long) seed);
+	printf("load time: %.3f ms\n", elapsedNs(&loadStart, &loadEnd) / 1e6);
+	printf("peak rss: %ld KB\n", peakRss());
+	struct Counters total;
+	sumCounters(&total);
+	printf("missiles: %llu launched, %llu landed in %.2f s (%.1f/s)\n",
+			(unsigned long long) total.launched, bench.landed,
+			secs, bench.landed / secs);
+	printf("hits: %llu on shield, %llu on city\n",
+			(unsigned long long) total.blocked,
+			(unsigned long long) total.cityHits);
+	histPrint("lock hold", &bench.lockHold);
+	histPrint("shield move", &bench.shield);
+	histPrint("frame time", &bench.frame);
+	histPrint("tick time", &bench.tick);
+	if (bench.kernel) printf("step kernel: %s\n", bench.kernel);
+	if (stats && !dumpStats(stats)) retval = 0;
+	destroyFrames();
+	destroyGame(game);
+	return (retval) ? EXIT_SUCCESS: EXIT_FAILURE;
+    }
 
-    if (!displayMessage("hit enter to close...", &row, &col, 0)) {
-	row_temp = 1;
-	displayMessage("hit enter to close...", &row_temp, &col, 0);
-	if (row_temp > row) row = row_temp;
+    if (!caught) {
+	postMessage(MSG_LOG, "hit enter to close...");
+	composeFrame();
+	showFrame();
+	waitForEnter();
     }
-    col = 0;
-    flushinp();
-    while (getch() != '\n');
     endwin();
 
+    if (stats && !dumpStats(stats)) retval = 0;
+    destroyFrames();
     destroyGame(game);
-    return 0;
+    return (retval) ? EXIT_SUCCESS: EXIT_FAILURE;
 }